@@ -0,0 +1,448 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __APPLE__
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+
+#define OUTPUT_CAPACITY (1 << 20)  /* output kept per command */
+#define PROMPT_TIMEOUT 30000       /* ms to wait for a prompt before giving up */
+
+/* an interactive shell running on a pty */
+typedef struct session {
+    int fd;        /* master side of the pty */
+    pid_t pid;
+    char *output;  /* output since the last command was sent */
+    size_t length;
+} session;
+
+/* options */
+char *shellPath = "./shell";
+int iterations = 1000;
+int reapJobs[8] = { 1000, 10000 };
+int numReapJobs = 2;
+
+/* starts the shell on a new pty with echo off and waits for its first prompt */
+int startSession(session *s);
+
+/* sends a line to the shell */
+void sendLine(session *s, char *line);
+
+/* reads output until the shell prints a prompt, returns -1 on timeout/EOF */
+int waitPrompt(session *s);
+
+/* sends line and waits for the next prompt, returns the round trip in us */
+double roundTrip(session *s, char *line);
+
+/* exits the shell and reaps it */
+void endSession(session *s);
+
+/* writes count copies of line to a new script, returns its path */
+char *writeScript(char *line, int count);
+
+/* runs the shell on a script with output discarded, returns the wall time in us */
+double runScript(char *path);
+
+/* runs shell -c command with output discarded, returns the wall time in us */
+double runCommand(char *command);
+
+/* prints p50/p99 of samples (sorts them) as a JSON line */
+void reportLatency(char *name, double *samples, int count);
+
+/* current monotonic time in us */
+double now();
+
+int compareDoubles(const void *a, const void *b);
+
+/* benchmarks */
+void benchStartup();
+void benchPtyLaunch();
+void benchPtyBuiltin();
+void benchBatchLaunch();
+void benchBackgroundThroughput();
+void benchReap(int liveJobs);
+
+int main(int argc, char **argv) {
+    int option;
+    int i;
+
+    while ((option = getopt(argc, argv, "n:k:")) != -1) {
+        switch (option) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'k': {
+            /* comma separated live job counts for the reap benchmark */
+            char *count = strtok(optarg, ",");
+
+            numReapJobs = 0;
+            while (count != NULL && numReapJobs < 8) {
+                reapJobs[numReapJobs++] = atoi(count);
+                count = strtok(NULL, ",");
+            }
+            break;
+        }
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-k jobs,...] [shell]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (optind < argc) {
+        shellPath = argv[optind];
+    }
+
+    if (access(shellPath, X_OK) != 0) {
+        fprintf(stderr, "bench: %s: %s\n", shellPath, strerror(errno));
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* keep the benchmark lines out of the user's history */
+    setenv("HISTFILE", "", 1);
+
+    benchStartup();
+    benchPtyLaunch();
+    benchPtyBuiltin();
+    benchBatchLaunch();
+    benchBackgroundThroughput();
+
+    for (i = 0; i < numReapJobs; i++) {
+        benchReap(reapJobs[i]);
+    }
+
+    return 0;
+}
+
+int startSession(session *s) {
+    struct termios attributes;
+
+    s->output = malloc(OUTPUT_CAPACITY);
+    s->length = 0;
+
+    s->pid = forkpty(&s->fd, NULL, NULL, NULL);
+    if (s->pid < 0) {
+        perror("forkpty");
+        return -1;
+    }
+
+    if (s->pid == 0) {
+        execl(shellPath, shellPath, (char *) NULL);
+        _exit(127);
+    }
+
+    /* the shell's output is all that's read back */
+    if (tcgetattr(s->fd, &attributes) == 0) {
+        attributes.c_lflag &= ~ECHO;
+        tcsetattr(s->fd, TCSANOW, &attributes);
+    }
+
+    return waitPrompt(s);
+}
+
+void sendLine(session *s, char *line) {
+    size_t length = strlen(line);
+    size_t written = 0;
+
+    s->length = 0;
+
+    while (written < length) {
+        ssize_t result = write(s->fd, line + written, length - written);
+
+        if (result < 0 && errno != EINTR) {
+            return;
+        }
+        if (result > 0) {
+            written += result;
+        }
+    }
+}
+
+int waitPrompt(session *s) {
+    struct pollfd fds;
+
+    fds.fd = s->fd;
+    fds.events = POLLIN;
+
+    while (1) {
+        ssize_t bytesRead;
+
+        if (s->length >= 2 && memcmp(s->output + s->length - 2, "> ", 2) == 0) {
+            /* only a prompt if nothing else follows right away */
+            if (poll(&fds, 1, 0) == 0) {
+                return 0;
+            }
+        }
+
+        if (poll(&fds, 1, PROMPT_TIMEOUT) <= 0) {
+            fprintf(stderr, "bench: timed out waiting for a prompt\n");
+            return -1;
+        }
+
+        /* keep the tail when the output outgrows the buffer */
+        if (s->length == OUTPUT_CAPACITY) {
+            memmove(s->output, s->output + OUTPUT_CAPACITY / 2, OUTPUT_CAPACITY / 2);
+            s->length = OUTPUT_CAPACITY / 2;
+        }
+
+        bytesRead = read(s->fd, s->output + s->length, OUTPUT_CAPACITY - s->length);
+        if (bytesRead <= 0) {
+            if (bytesRead < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        s->length += bytesRead;
+    }
+}
+
+double roundTrip(session *s, char *line) {
+    double start = now();
+
+    sendLine(s, line);
+    if (waitPrompt(s) < 0) {
+        return -1;
+    }
+
+    return now() - start;
+}
+
+void endSession(session *s) {
+    int status;
+
+    sendLine(s, "exit\n");
+
+    /* drain until the pty closes so the shell never blocks writing */
+    while (waitPrompt(s) == 0) {
+        sendLine(s, "exit\n");
+    }
+
+    close(s->fd);
+    waitpid(s->pid, &status, 0);
+    free(s->output);
+}
+
+char *writeScript(char *line, int count) {
+    static char path[] = "/tmp/shell-bench-XXXXXX";
+    FILE *script;
+    int fd;
+    int i;
+
+    strcpy(path, "/tmp/shell-bench-XXXXXX");
+    if ((fd = mkstemp(path)) < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+
+    script = fdopen(fd, "w");
+    for (i = 0; i < count; i++) {
+        fputs(line, script);
+    }
+    fclose(script);
+
+    return path;
+}
+
+double runScript(char *path) {
+    double start = now();
+    int status;
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        execl(shellPath, shellPath, path, (char *) NULL);
+        _exit(127);
+    }
+
+    waitpid(pid, &status, 0);
+    return now() - start;
+}
+
+double runCommand(char *command) {
+    double start = now();
+    int status;
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        execl(shellPath, shellPath, "-c", command, (char *) NULL);
+        _exit(127);
+    }
+
+    waitpid(pid, &status, 0);
+    return now() - start;
+}
+
+void reportLatency(char *name, double *samples, int count) {
+    if (count == 0) {
+        printf("{\"bench\":\"%s\",\"error\":\"no samples\"}\n", name);
+        return;
+    }
+
+    qsort(samples, count, sizeof(double), compareDoubles);
+    printf("{\"bench\":\"%s\",\"n\":%d,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+            name, count, samples[count / 2], samples[(int) (count * 0.99)], samples[count - 1]);
+    fflush(stdout);
+}
+
+double now() {
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e6 + time.tv_nsec / 1e3;
+}
+
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+void benchStartup() {
+    double *samples = malloc(iterations * sizeof(double));
+    int count;
+
+    /* shell -c '' and back */
+    for (count = 0; count < iterations; count++) {
+        samples[count] = runCommand("");
+    }
+    reportLatency("startup_batch", samples, count);
+
+    /* exec to first prompt on a pty */
+    for (count = 0; count < iterations; count++) {
+        session s;
+        double start = now();
+
+        if (startSession(&s) < 0) {
+            break;
+        }
+        samples[count] = now() - start;
+        endSession(&s);
+    }
+    reportLatency("startup_pty", samples, count);
+
+    free(samples);
+}
+
+void benchPtyLaunch() {
+    session s;
+    double *samples = malloc(iterations * sizeof(double));
+    int count = 0;
+
+    if (startSession(&s) == 0) {
+        while (count < iterations && (samples[count] = roundTrip(&s, "true\n")) >= 0) {
+            count++;
+        }
+        endSession(&s);
+    }
+
+    reportLatency("pty_launch_true", samples, count);
+    free(samples);
+}
+
+void benchPtyBuiltin() {
+    session s;
+    double *samples = malloc(iterations * sizeof(double));
+    int count = 0;
+
+    if (startSession(&s) == 0) {
+        while (count < iterations && (samples[count] = roundTrip(&s, "cd .\n")) >= 0) {
+            count++;
+        }
+        endSession(&s);
+    }
+
+    reportLatency("pty_builtin_cd", samples, count);
+    free(samples);
+}
+
+void benchBatchLaunch() {
+    char *path = writeScript("true\n", iterations);
+    double elapsed = runScript(path);
+
+    printf("{\"bench\":\"batch_launch_true\",\"n\":%d,\"total_us\":%.1f,\"per_command_us\":%.1f}\n",
+            iterations, elapsed, elapsed / iterations);
+    fflush(stdout);
+    unlink(path);
+}
+
+void benchBackgroundThroughput() {
+    char *path = writeScript("sleep 0 &\n", iterations);
+    double elapsed = runScript(path);
+
+    printf("{\"bench\":\"batch_background_sleep0\",\"n\":%d,\"total_us\":%.1f,\"jobs_per_sec\":%.1f}\n",
+            iterations, elapsed, iterations / (elapsed / 1e6));
+    fflush(stdout);
+    unlink(path);
+}
+
+void benchReap(int liveJobs) {
+    session s;
+    double start, elapsed;
+    int remaining = -1;
+    int i;
+
+    if (startSession(&s) < 0) {
+        return;
+    }
+
+    /* long running jobs the shell has to keep track of while reaping */
+    for (i = 0; i < liveJobs; i++) {
+        if (roundTrip(&s, "sleep 1000 &\n") < 0) {
+            printf("{\"bench\":\"reap\",\"live_jobs\":%d,\"error\":\"could only start %d jobs\"}\n", liveJobs, i);
+            endSession(&s);
+            return;
+        }
+    }
+
+    start = now();
+
+    for (i = 0; i < iterations; i++) {
+        roundTrip(&s, "true &\n");
+    }
+
+    /* done once jobs lists only the sleeps again */
+    while (remaining != liveJobs && now() - start < PROMPT_TIMEOUT * 1000.0) {
+        size_t offset;
+
+        if (roundTrip(&s, "jobs\n") < 0) {
+            break;
+        }
+
+        remaining = 0;
+        for (offset = 0; offset < s.length; offset++) {
+            if (s.output[offset] == '[' && (offset == 0 || s.output[offset - 1] == '\n')) {
+                remaining++;
+            }
+        }
+    }
+
+    elapsed = now() - start;
+
+    printf("{\"bench\":\"reap\",\"live_jobs\":%d,\"n\":%d,\"total_us\":%.1f,\"per_job_us\":%.1f}\n",
+            liveJobs, iterations, elapsed, elapsed / iterations);
+    fflush(stdout);
+
+    endSession(&s);
+}
@@ -0,0 +1,776 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __APPLE__
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+
+#define LINE_CAPACITY 65536   /* longest output line kept */
+#define SYNC_TIMEOUT 60000    /* ms to wait for the shell to get through a batch */
+#define MAX_JOB_ID 65536      /* above the shell's job table capacity */
+#define MAX_ERRORS 20         /* errors printed, the rest are only counted */
+#define STOP_INTERVAL 5       /* rounds between stopping a foreground job with ^Z */
+
+/* job states as the shell's trace reports them */
+#define TRACE_TERMINATED 2
+#define TRACE_COMPLETED 3
+
+/* what a launched job runs */
+typedef enum job_kind {
+    KIND_TRUE,     /* true &, gone before anyone looks */
+    KIND_SHORT,    /* sleep 0.2 &, some are brought to the foreground with fg */
+    KIND_LONG,     /* sleep 1000 &, killed in the same round */
+    KIND_IDLE,     /* sleep 1000 &, kept running for the whole run */
+    KIND_STOPPED   /* sleep 1000, stopped with ^Z, continued with bg and killed */
+} job_kind;
+
+/* one job as the shell reported it */
+typedef struct launch {
+    int id;        /* -1 until the shell printed "[id] pgid" for it */
+    pid_t pgid;
+    job_kind kind;
+    int gone;      /* brought to the foreground, so it has left the job table */
+    int killed;    /* kill %id was sent */
+    int reports;   /* "terminated by signal" notifications seen */
+} launch;
+
+/* an interactive shell on a pty, and what its output said so far */
+typedef struct run {
+    int fd;                 /* master side of the pty */
+    pid_t pid;
+    char line[LINE_CAPACITY];
+    size_t length;          /* of the partial line in line */
+    int eof;
+    launch *launches;
+    int numLaunches;
+    int nextAck;            /* first launch that may still be waiting for its "[id] pgid" */
+    int byId[MAX_JOB_ID];   /* latest launch given each job id, -1 if none */
+    int listedIn[MAX_JOB_ID];  /* listing each job id was last seen in */
+    int listing;            /* number of the current jobs listing, 0 outside one */
+    int listings;
+    int listedJobs;         /* entries in the current listing */
+    int expectStopped;      /* whether a listing may show a job stopped with ^Z */
+    int syncSeen;           /* highest sync marker seen */
+    int syncSent;
+    int errors;
+} run;
+
+/* options */
+char *shellPath = "./shell";
+int numJobs = 2000;
+int batchSize = 50;
+int liveCounts[8] = { 0, 1000 };
+int numLiveCounts = 2;
+
+/* starts the shell on a new pty (echo off, tracing to tracePath) */
+int startRun(run *r, char *tracePath);
+
+/* writes text to the shell while reading its output, so neither side can
+ * block the other */
+void sendText(run *r, char *format, ...);
+
+/* sends a sync marker and reads output until the shell gets to it, returns
+ * -1 on timeout or end of output */
+int syncShell(run *r);
+
+/* sends a jobs listing between markers and waits for it, returns the number
+ * of jobs listed or -1 */
+int listJobs(run *r);
+
+/* reads what output is available (waiting up to timeout ms), handling every
+ * complete line. Returns -1 at end of output */
+int readOutput(run *r, int timeout);
+
+/* checks one line of output against what is known about the jobs */
+void handleLine(run *r, char *line);
+
+/* removes carriage returns and terminal escape sequences in place */
+void cleanLine(char *line);
+
+/* sends background launches of the given kind and records them */
+void launchJobs(run *r, job_kind kind, int count);
+
+/* runs a foreground job and stops it with ^Z once it has the terminal,
+ * returns -1 if it never got it */
+int stopForeground(run *r);
+
+/* checks that every job was reported the way its kind requires */
+void checkAccounting(run *r);
+
+/* records (and prints the first few) inconsistencies */
+void error(run *r, char *format, ...);
+
+/* exits the shell, drains its output and reaps it */
+void endRun(run *r);
+
+/* reads the shell's trace and prints the reap and cleanup latencies */
+void reportLatencies(char *tracePath, int liveJobs);
+
+/* prints p50/p99 of samples (sorts them) as a JSON line */
+void reportLatency(char *name, int liveJobs, double *samples, int count);
+
+/* current monotonic time in us */
+double now();
+
+int compareDoubles(const void *a, const void *b);
+
+/* one stress run with liveJobs idle jobs in the table throughout, returns
+ * the number of errors */
+int stress(int liveJobs);
+
+int main(int argc, char **argv) {
+    int option;
+    int errors = 0;
+    int i;
+
+    while ((option = getopt(argc, argv, "n:b:k:")) != -1) {
+        switch (option) {
+        case 'n':
+            numJobs = atoi(optarg);
+            break;
+        case 'b':
+            batchSize = atoi(optarg);
+            break;
+        case 'k': {
+            /* comma separated idle job counts, one run each */
+            char *count = strtok(optarg, ",");
+
+            numLiveCounts = 0;
+            while (count != NULL && numLiveCounts < 8) {
+                liveCounts[numLiveCounts++] = atoi(count);
+                count = strtok(NULL, ",");
+            }
+            break;
+        }
+        default:
+            fprintf(stderr, "usage: %s [-n jobs] [-b batch] [-k idle,...] [shell]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (optind < argc) {
+        shellPath = argv[optind];
+    }
+
+    if (access(shellPath, X_OK) != 0) {
+        fprintf(stderr, "stress: %s: %s\n", shellPath, strerror(errno));
+        return 1;
+    }
+
+    if (batchSize < 10) {
+        batchSize = 10;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    setenv("HISTFILE", "", 1);
+
+    for (i = 0; i < numLiveCounts; i++) {
+        errors += stress(liveCounts[i]);
+    }
+
+    return errors > 0 ? 1 : 0;
+}
+
+int stress(int liveJobs) {
+    run *r = calloc(1, sizeof(run));
+    char tracePath[] = "/tmp/shell-stress-XXXXXX";
+    int fgJobs = 0, stopped = 0, killed = 0;
+    double start;
+    int round;
+    int launched;
+    int i;
+
+    close(mkstemp(tracePath));
+
+    if (startRun(r, tracePath) < 0) {
+        unlink(tracePath);
+        free(r);
+        return 1;
+    }
+    r->launches = malloc((numJobs + liveJobs + numJobs / STOP_INTERVAL + 16) * sizeof(launch));
+
+    start = now();
+
+    /* jobs the shell has to keep track of while everything else happens */
+    for (launched = 0; launched < liveJobs && r->errors == 0; launched += batchSize) {
+        launchJobs(r, KIND_IDLE, liveJobs - launched < batchSize ? liveJobs - launched : batchSize);
+        if (syncShell(r) < 0) {
+            break;
+        }
+    }
+
+    for (round = 0, launched = 0; launched < numJobs && !r->eof; round++) {
+        int first = r->numLaunches;
+        int count = numJobs - launched < batchSize ? numJobs - launched : batchSize;
+        int fgThisRound = 0;
+
+        /* most jobs exit right away, a few linger to be killed or brought back */
+        for (i = 0; i < count; i++) {
+            launchJobs(r, i % 10 == 0 ? KIND_LONG : i % 10 == 5 ? KIND_SHORT : KIND_TRUE, 1);
+        }
+        launched += count;
+        if (syncShell(r) < 0) {
+            break;
+        }
+
+        /* list, kill and fg while the rest of them are exiting */
+        sendText(r, "cd /stress-list-%d\njobs\n", ++r->listings);
+        for (i = first; i < r->numLaunches; i++) {
+            launch *l = &r->launches[i];
+
+            if (l->id < 0 || r->byId[l->id] != i) {
+                continue;
+            }
+            if (l->kind == KIND_LONG) {
+                sendText(r, "kill %%%d\n", l->id);
+                l->killed = 1;
+            } else if (l->kind == KIND_SHORT && fgThisRound < 2) {
+                sendText(r, "fg %%%d\n", l->id);
+                fgThisRound++;
+                fgJobs++;
+            }
+        }
+        if (syncShell(r) < 0) {
+            break;
+        }
+
+        /* the listing before fg could still show them, later ones can't */
+        for (i = first; i < r->numLaunches; i++) {
+            if (r->launches[i].kind == KIND_SHORT && r->launches[i].id >= 0
+                    && r->byId[r->launches[i].id] == i && fgThisRound-- > 0) {
+                r->launches[i].gone = 1;
+            }
+        }
+        if (listJobs(r) < 0) {
+            break;
+        }
+
+        if (round % STOP_INTERVAL == STOP_INTERVAL - 1) {
+            if (stopForeground(r) < 0) {
+                break;
+            }
+            stopped++;
+        }
+    }
+
+    /* the idle jobs go too, after which nothing may be left */
+    for (i = 0; i < r->numLaunches && !r->eof; i++) {
+        launch *l = &r->launches[i];
+
+        if (l->kind == KIND_IDLE && l->id >= 0) {
+            sendText(r, "kill %%%d\n", l->id);
+            l->killed = 1;
+            if (i % batchSize == batchSize - 1 && syncShell(r) < 0) {
+                break;
+            }
+        }
+    }
+
+    if (!r->eof) {
+        sendText(r, "wait\n");
+        if (syncShell(r) == 0) {
+            int remaining = listJobs(r);
+
+            if (remaining != 0) {
+                error(r, "%d jobs still listed after wait", remaining);
+            }
+        }
+    }
+
+    endRun(r);
+    checkAccounting(r);
+
+    for (i = 0; i < r->numLaunches; i++) {
+        killed += r->launches[i].killed;
+    }
+
+    printf("{\"stress\":\"jobs\",\"live_jobs\":%d,\"launched\":%d,\"killed\":%d,\"fg\":%d,"
+            "\"stopped\":%d,\"errors\":%d,\"total_s\":%.2f}\n",
+            liveJobs, r->numLaunches, killed, fgJobs, stopped, r->errors, (now() - start) / 1e6);
+    fflush(stdout);
+
+    reportLatencies(tracePath, liveJobs);
+    unlink(tracePath);
+
+    i = r->errors;
+    free(r->launches);
+    free(r);
+    return i;
+}
+
+int startRun(run *r, char *tracePath) {
+    struct termios attributes;
+
+    memset(r->byId, -1, sizeof(r->byId));
+    setenv("SHELL_TRACE", tracePath, 1);
+
+    r->pid = forkpty(&r->fd, NULL, NULL, NULL);
+    if (r->pid < 0) {
+        perror("forkpty");
+        return -1;
+    }
+
+    if (r->pid == 0) {
+        execl(shellPath, shellPath, (char *) NULL);
+        _exit(127);
+    }
+
+    /* the shell's output is all that's read back */
+    if (tcgetattr(r->fd, &attributes) == 0) {
+        attributes.c_lflag &= ~ECHO;
+        tcsetattr(r->fd, TCSANOW, &attributes);
+    }
+    fcntl(r->fd, F_SETFL, O_NONBLOCK);
+
+    return syncShell(r);
+}
+
+void sendText(run *r, char *format, ...) {
+    char text[256];
+    size_t length;
+    size_t written = 0;
+    va_list args;
+
+    va_start(args, format);
+    length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    while (written < length && !r->eof) {
+        struct pollfd fds = { r->fd, POLLIN | POLLOUT, 0 };
+        ssize_t result;
+
+        if (poll(&fds, 1, SYNC_TIMEOUT) <= 0) {
+            error(r, "timed out writing to the shell");
+            r->eof = 1;
+            return;
+        }
+
+        if (fds.revents & (POLLIN | POLLHUP)) {
+            readOutput(r, 0);
+        }
+
+        if (fds.revents & POLLOUT) {
+            result = write(r->fd, text + written, length - written);
+            if (result > 0) {
+                written += result;
+            } else if (result < 0 && errno != EINTR && errno != EAGAIN) {
+                r->eof = 1;
+            }
+        }
+    }
+}
+
+int syncShell(run *r) {
+    int marker = ++r->syncSent;
+    double deadline = now() + SYNC_TIMEOUT * 1000.0;
+
+    sendText(r, "cd /stress-sync-%d\n", marker);
+
+    while (r->syncSeen < marker) {
+        if (r->eof || now() > deadline) {
+            /* a lost state change leaves fg or wait waiting forever */
+            error(r, "%s waiting for sync %d", r->eof ? "shell exited" : "timed out", marker);
+            r->eof = 1;
+            return -1;
+        }
+        readOutput(r, 100);
+    }
+
+    return 0;
+}
+
+int listJobs(run *r) {
+    sendText(r, "cd /stress-list-%d\njobs\n", ++r->listings);
+    if (syncShell(r) < 0) {
+        return -1;
+    }
+    return r->listedJobs;
+}
+
+int readOutput(run *r, int timeout) {
+    struct pollfd fds = { r->fd, POLLIN, 0 };
+
+    if (poll(&fds, 1, timeout) <= 0) {
+        return 0;
+    }
+
+    while (1) {
+        ssize_t bytesRead = read(r->fd, r->line + r->length, LINE_CAPACITY - 1 - r->length);
+        size_t start = 0;
+        size_t i;
+
+        if (bytesRead <= 0) {
+            if (bytesRead < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytesRead == 0 || errno != EAGAIN) {
+                /* EIO once the shell closed the pty */
+                r->eof = 1;
+                return -1;
+            }
+            return 0;
+        }
+
+        for (i = r->length; i < r->length + bytesRead; i++) {
+            if (r->line[i] == '\n') {
+                r->line[i] = '\0';
+                handleLine(r, r->line + start);
+                start = i + 1;
+            }
+        }
+        r->length += bytesRead - start;
+        memmove(r->line, r->line + start, r->length);
+
+        /* a line that long is nothing this checks */
+        if (r->length == LINE_CAPACITY - 1) {
+            r->length = 0;
+        }
+    }
+}
+
+void handleLine(run *r, char *line) {
+    char *bracket;
+    char *rest;
+    char *marker;
+    int id, pgid, consumed, signum;
+    launch *l;
+
+    cleanLine(line);
+
+    if (strstr(line, "Sanitizer") != NULL || strstr(line, "runtime error:") != NULL) {
+        error(r, "sanitizer: %s", line);
+        return;
+    }
+
+    /* markers come back as cd errors, distinct from the echoed command */
+    if ((marker = strstr(line, "directory: /stress-")) != NULL) {
+        int number;
+
+        if (sscanf(marker, "directory: /stress-sync-%d", &number) == 1) {
+            r->syncSeen = number;
+            r->listing = 0;
+        } else if (sscanf(marker, "directory: /stress-list-%d", &number) == 1) {
+            r->listing = number;
+            r->listedJobs = 0;
+        }
+        return;
+    }
+
+    /* job lines start at "[id] pgid", after whatever prompt was redrawn */
+    for (bracket = strchr(line, '['); bracket != NULL; bracket = strchr(bracket + 1, '[')) {
+        if (sscanf(bracket, "[%d] %d%n", &id, &pgid, &consumed) == 2) {
+            break;
+        }
+    }
+    if (bracket == NULL) {
+        return;
+    }
+    rest = bracket + consumed;
+
+    if (id <= 0 || id >= MAX_JOB_ID) {
+        error(r, "bad job id: %s", line);
+        return;
+    }
+    l = r->byId[id] >= 0 ? &r->launches[r->byId[id]] : NULL;
+
+    if (*rest == '\0') {
+        /* a background launch, in the order they were sent */
+        while (r->nextAck < r->numLaunches && r->launches[r->nextAck].id >= 0) {
+            r->nextAck++;
+        }
+        if (r->nextAck == r->numLaunches) {
+            error(r, "launch reported that wasn't sent: [%d] %d", id, pgid);
+            return;
+        }
+        if (l != NULL && l->kind != KIND_TRUE && l->kind != KIND_SHORT && l->reports == 0) {
+            error(r, "job id %d reused while [%d] %d was still running", id, l->id, l->pgid);
+        }
+        r->launches[r->nextAck].id = id;
+        r->launches[r->nextAck].pgid = pgid;
+        r->byId[id] = r->nextAck++;
+        return;
+    }
+
+    if (sscanf(rest, " terminated by signal %d", &signum) == 1) {
+        if (l == NULL || l->pgid != pgid) {
+            error(r, "termination of a job that wasn't running: %s", line);
+        } else if (!l->killed) {
+            error(r, "termination of a job that wasn't killed: %s", line);
+        } else if (++l->reports > 1) {
+            error(r, "termination reported %d times: %s", l->reports, line);
+        }
+        return;
+    }
+
+    if (r->listing == 0) {
+        error(r, "unexpected output: %s", line);
+        return;
+    }
+
+    r->listedJobs++;
+    if (r->listedIn[id] == r->listing) {
+        error(r, "job %d listed twice", id);
+    }
+    r->listedIn[id] = r->listing;
+
+    if (l == NULL || l->pgid != pgid) {
+        if (r->expectStopped && strncmp(rest, " Stopped ", 9) == 0) {
+            /* the foreground job that was just stopped joins the table */
+            l = &r->launches[r->numLaunches];
+            l->id = id;
+            l->pgid = pgid;
+            l->kind = KIND_STOPPED;
+            l->gone = l->killed = l->reports = 0;
+            r->byId[id] = r->numLaunches++;
+            r->expectStopped = 0;
+        } else {
+            error(r, "listed job that wasn't launched: %s", line);
+        }
+    } else if (l->gone || l->reports > 0) {
+        error(r, "listed job that had already finished: %s", line);
+    }
+}
+
+void cleanLine(char *line) {
+    char *in = line;
+    char *out = line;
+
+    while (*in != '\0') {
+        if (*in == '\r') {
+            in++;
+        } else if (*in == '\x1b' && in[1] == '[') {
+            /* CSI: parameters, then a final byte */
+            in += 2;
+            while (*in != '\0' && (*in < '@' || *in > '~')) {
+                in++;
+            }
+            if (*in != '\0') {
+                in++;
+            }
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
+}
+
+void launchJobs(run *r, job_kind kind, int count) {
+    static char *commands[] = {
+        [KIND_TRUE] = "true &\n",
+        [KIND_SHORT] = "sleep 0.2 &\n",
+        [KIND_LONG] = "sleep 1000 &\n",
+        [KIND_IDLE] = "sleep 1000 &\n"
+    };
+    int i;
+
+    for (i = 0; i < count; i++) {
+        launch *l = &r->launches[r->numLaunches++];
+
+        l->id = -1;
+        l->pgid = -1;
+        l->kind = kind;
+        l->gone = l->killed = l->reports = 0;
+        sendText(r, "%s", commands[kind]);
+    }
+}
+
+int stopForeground(run *r) {
+    double deadline = now() + SYNC_TIMEOUT * 1000.0;
+    int found;
+    int i;
+
+    sendText(r, "sleep 1000\n");
+
+    /* ^Z only stops it once its group has the terminal */
+    while (tcgetpgrp(r->fd) == r->pid) {
+        if (r->eof || now() > deadline) {
+            error(r, "foreground job never got the terminal");
+            return -1;
+        }
+        readOutput(r, 1);
+    }
+    sendText(r, "\x1a");
+
+    r->expectStopped = 1;
+    found = r->numLaunches;
+    if (listJobs(r) < 0) {
+        return -1;
+    }
+    if (r->expectStopped) {
+        error(r, "job stopped with ^Z not listed as stopped");
+        r->expectStopped = 0;
+        return -1;
+    }
+
+    for (i = found; i < r->numLaunches; i++) {
+        sendText(r, "bg %%%d\nkill %%%d\n", r->launches[i].id, r->launches[i].id);
+        r->launches[i].killed = 1;
+    }
+
+    return syncShell(r);
+}
+
+void checkAccounting(run *r) {
+    int i;
+
+    for (i = 0; i < r->numLaunches; i++) {
+        launch *l = &r->launches[i];
+
+        if (l->id < 0) {
+            error(r, "launch %d was never reported", i);
+        } else if (l->killed && l->reports != 1) {
+            error(r, "killed job [%d] %d reported %d times", l->id, l->pgid, l->reports);
+        }
+    }
+}
+
+void error(run *r, char *format, ...) {
+    va_list args;
+
+    if (r->errors++ >= MAX_ERRORS) {
+        return;
+    }
+
+    fprintf(stderr, "stress: ");
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+}
+
+void endRun(run *r) {
+    int status;
+    double deadline = now() + SYNC_TIMEOUT * 1000.0;
+
+    if (!r->eof) {
+        sendText(r, "exit\n");
+    }
+
+    /* sanitizer reports come at exit too */
+    while (!r->eof && now() < deadline) {
+        readOutput(r, 100);
+    }
+    if (!r->eof) {
+        kill(r->pid, SIGKILL);
+    }
+
+    close(r->fd);
+    waitpid(r->pid, &status, 0);
+
+    if (WIFSIGNALED(status)) {
+        error(r, "shell killed by signal %d", WTERMSIG(status));
+    }
+}
+
+void reportLatencies(char *tracePath, int liveJobs) {
+    FILE *trace = fopen(tracePath, "r");
+    char line[512];
+    long lastSigchld = -1;
+    long *finished;
+    double *reap, *cleanup;
+    int numReap = 0, numCleanup = 0;
+    int capacity = 1024;
+    long pidMax = 4194304;
+    FILE *limit = fopen("/proc/sys/kernel/pid_max", "r");
+
+    if (trace == NULL) {
+        return;
+    }
+    if (limit != NULL) {
+        if (fscanf(limit, "%ld", &pidMax) != 1) {
+            pidMax = 4194304;
+        }
+        fclose(limit);
+    }
+
+    /* when each pid last finished, for the wait until its job is cleaned up */
+    finished = calloc(pidMax + 1, sizeof(long));
+    reap = malloc(capacity * sizeof(double));
+    cleanup = malloc(capacity * sizeof(double));
+
+    while (fgets(line, sizeof(line), trace) != NULL) {
+        char event[32];
+        long time, arg;
+        int pid;
+
+        if (sscanf(line, "{\"seq\":%*u,\"ts_ns\":%ld,\"event\":\"%31[^\"]\",\"phase\":\"%*c\",\"pid\":%d,\"arg\":%ld}",
+                &time, event, &pid, &arg) != 4) {
+            continue;
+        }
+
+        if (numReap == capacity || numCleanup == capacity) {
+            capacity *= 2;
+            reap = realloc(reap, capacity * sizeof(double));
+            cleanup = realloc(cleanup, capacity * sizeof(double));
+        }
+
+        if (strcmp(event, "sigchld") == 0) {
+            lastSigchld = time;
+        } else if (strcmp(event, "state") == 0) {
+            if (arg != TRACE_COMPLETED && arg != TRACE_TERMINATED) {
+                continue;
+            }
+            /* reaped in response to a SIGCHLD, not by a blocking wait */
+            if (lastSigchld >= 0) {
+                reap[numReap++] = (time - lastSigchld) / 1e3;
+            }
+            if (pid > 0 && pid <= pidMax) {
+                finished[pid] = time;
+            }
+        } else {
+            lastSigchld = -1;
+            if (strcmp(event, "cleanup") == 0 && pid > 0 && pid <= pidMax && finished[pid] > 0) {
+                cleanup[numCleanup++] = (time - finished[pid]) / 1e3;
+                finished[pid] = 0;
+            }
+        }
+    }
+    fclose(trace);
+
+    reportLatency("reap_latency", liveJobs, reap, numReap);
+    reportLatency("cleanup_latency", liveJobs, cleanup, numCleanup);
+
+    free(finished);
+    free(reap);
+    free(cleanup);
+}
+
+void reportLatency(char *name, int liveJobs, double *samples, int count) {
+    if (count == 0) {
+        printf("{\"stress\":\"%s\",\"live_jobs\":%d,\"error\":\"no samples\"}\n", name, liveJobs);
+        return;
+    }
+
+    qsort(samples, count, sizeof(double), compareDoubles);
+    printf("{\"stress\":\"%s\",\"live_jobs\":%d,\"n\":%d,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+            name, liveJobs, count, samples[count / 2], samples[(int) (count * 0.99)], samples[count - 1]);
+    fflush(stdout);
+}
+
+double now() {
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e6 + time.tv_nsec / 1e3;
+}
+
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
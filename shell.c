@@ -1,16 +1,121 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sched.h>
+#include <linux/sched.h>
+#include <linux/mempolicy.h>
+#endif
 #include <signal.h>
-
-#define COMMAND_LENGTH 1
-#define JOBS_CAPACITY 10000
+#include <spawn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <time.h>
+#include <stdarg.h>
+#include <dirent.h>
+
+#define ARENA_ALIGN 16       /* alignment of arena allocations */
+#define ARENA_MIN_SIZE 4096  /* initial arena size */
+
+#define TTY_BUFFER_SIZE 4096     /* input buffer when reading from a terminal */
+#define READ_BUFFER_SIZE 65536   /* input buffer otherwise (pipes, scripts) */
+#define JOBS_CAPACITY 16384
+#define PID_BUCKETS 16384  /* power of two, buckets in process pid hash */
+
+/* command hash (resolved $PATH lookups) */
+#define HASH_BUCKETS 512
+#define HASH_RECHECK_INTERVAL 1000000000L  /* ns between mtime checks of a $PATH directory */
+#define DEFAULT_PATH "/bin:/usr/bin"       /* used when $PATH is unset */
+#define HASH_MAX_FDS 256                   /* hashed commands holding an fd, the rest exec by path */
+
+/* executing hashed commands through the fd they were looked up with, so
+ * what runs is the file that was checked (Linux) */
+#if defined(__linux__) && defined(O_PATH)
+#define EXEC_BY_FD
+#endif
+
+/* serving command lines over a Unix socket (shell --serve, Linux) */
+#ifdef __linux__
+#define SERVE_MODE
+#endif
+
+#define DIRENT_BUFFER_SIZE 32768   /* bytes of directory entries read per getdents64 */
+#define GLOB_BUFFER_SIZE (1 << 20) /* the same when expanding globs, for huge directories */
+#define GLOB_BLOCK_SIZE 65536      /* glob listings are stored in arena blocks of this size */
+#define COMPLETION_LIST_MAX 200    /* candidates listed at most on a second tab */
+
+#define INTERN_BUCKETS 256  /* buckets in the interned string table */
+#define VAR_BUCKETS 1024    /* power of two, buckets in the shell variable table */
+
+/* history */
+#define HISTORY_FILE ".shell_history"   /* in $HOME, unless $HISTFILE is set */
+#define HISTORY_BLOCK_ENTRIES 32        /* entries summarized by one search signature */
+#define HISTORY_SIGNATURE_BITS 4096     /* power of two, trigram bloom filter bits per block */
+
+#define OUTPUT_BUFFER_SIZE 65536  /* stdout buffer, flushed once per prompt cycle */
+
+#define DEFAULT_PREALLOC_SIZE (64L << 20)  /* bytes reserved for >| output without $SHELL_PREALLOC_SIZE */
+
+#define TRACE_CAPACITY 65536  /* power of two, events the trace keeps (older ones are overwritten) */
+
+#define SERVE_MAX_REQUEST 65536  /* bytes of a command line sent to a --serve shell */
+#define SERVE_MAX_REPLY 512      /* bytes of a reply to one */
+
+/* supervising children through pidfds (Linux 5.4+, opt in with $SHELL_PIDFD) */
+#if defined(__linux__) && defined(SYS_pidfd_open)
+#define PIDFD_SUPERVISION
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+#define SUPERVISOR_EVENTS 64  /* epoll events handled per epoll_wait */
+#endif
+
+/* launching through a helper forked at startup (opt in with $SHELL_ZYGOTE).
+ * It clones with CLONE_PARENT, so what it launches are the shell's children */
+#if defined(__linux__) && defined(SYS_clone)
+#define ZYGOTE_LAUNCHER
+#define ZYGOTE_MAX_REQUEST 65536  /* bytes per launch request, bigger ones launch in the shell */
+#define ZYGOTE_MAX_FDS 64         /* fds passed per launch request */
+#endif
+
+/* starting processes directly in a job's cgroup (Linux 5.7+) */
+#if defined(__linux__) && defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+#define CGROUP_CLONE
+#endif
+#define CGROUP_CPU_PERIOD 100000  /* us, the period cpu.max quotas are given for */
+
+#define PLACEMENT_MAX_CPUS 1024   /* cpus and nodes a placement can name */
+#define NODE_SYSFS "/sys/devices/system/node"
+
+/* directory entries come in getdents64 batches on Linux, one readdir() at a
+ * time in the same layout elsewhere */
+#ifndef __linux__
+#define dirent64 dirent
+#endif
+
+extern char **environ;
 
 /* jobs */
 /* job states */
@@ -21,223 +126,1269 @@ typedef enum job_state {
     COMPLETED    /* job completed normally */
 } job_state;
 
+/* a single process of a job (one stage of a pipeline) */
+typedef struct process {
+    pid_t pid;
+    job_state state;           /* COMPLETED/TERMINATED once it is done */
+    int termSig;               /* terminating signal if TERMINATED */
+    int exitCode;              /* exit code if COMPLETED */
+    struct job *job;           /* job the process belongs to */
+    struct process *pidNext;   /* next process in the same pid hash bucket */
+    int pidfd;                 /* pidfd watched by the supervisor, -1 if none */
+} process;
+
 /* structure representing a single job */
 typedef struct job {
     int id;                 /* job id */
-    char *command;          /* absolute path to executable */
+    char *command;          /* absolute path to executable (of the first stage) */
     char *originalCommand;  /* tokens converted back to a string (for jobs output) */
     pid_t pgid;             /* process group id */
     job_state state;        /* job state */
     int bgProcess;          /* whether job is running in background/foreground */
     int termSig;            /* if job was terminated by signal, the terminating signal */
+    int exitCode;           /* if job completed, the exit code of its last stage */
+    process *procs;         /* processes in pipeline order, the leader first */
+    process inlineProc;     /* storage for procs of single process jobs */
+    int numProcs;
+    int liveProcs;          /* processes that haven't exited/been terminated */
+    struct timespec startTime;  /* monotonic time the job was launched */
+    struct timespec endTime;    /* monotonic time its last process finished */
+    struct rusage usage;        /* resources used by its finished processes */
+    int slot;               /* slot of a parallel task or client of a served one, -1 for other jobs */
+    int waited;             /* whether the wait builtin is waiting for it */
+    char *cgroup;           /* its cgroup, relative to cgroupRootFd, or NULL */
+    char *placement;        /* cpus/node it was pinned to (for jobs -l), or NULL */
     struct job *next;       /* next job in linked list */
+    struct job *prev;       /* previous job in linked list */
+    struct job *doneNext;   /* next job in the completion queue */
 } job;
 
-/* head/tail of job linked list */
+/* job records come from a fixed pool instead of malloc, and go back to it
+ * through a free list (linked by next) */
+job jobPool[JOBS_CAPACITY];
+int jobPoolUsed = 0;   /* records handed out from the pool so far */
+job *freeJobs = NULL;
+
+/* head/tail of job linked list (jobs in creation order, for jobs output) */
 job *jobListHead = NULL;
 job *jobListTail = NULL;
 
+/* jobs indexed by job id, and their live processes hashed by pid, for O(1) lookups */
+job *jobTable[JOBS_CAPACITY + 1];
+process *pidHash[PID_BUCKETS];
+
+/* exit status of each cleaned up job whose id hasn't been reused yet, so
+ * wait still finds jobs that finished before it ran. -1 if none */
+int finishedStatus[JOBS_CAPACITY + 1];
+
+/* jobs that finished since the last cleanUpJobs(), in completion order, so
+ * cleaning up never walks the jobs that are still running */
+job *doneHead = NULL;
+job *doneTail = NULL;
+
 /* to track job ids */
 int nextJobId = 1;
 int activeJobs = 0;
 
+/* readable whenever children changed state */
+int childEventFd = -1;
+int sigchldFd = -1;     /* signalfd, or self-pipe read end, for SIGCHLD */
+#ifndef __linux__
+int childEventPipe[2];  /* self-pipe written by sigchldHandler */
+#endif
+
+/* epoll instance watching a pidfd per process (children are then reaped one
+ * by one through their pidfds instead of by pid), -1 if not in use. Its
+ * SIGCHLD fd only reports stops */
+int supervisorFd = -1;
+int untrackedProcs = 0;  /* live processes without a pidfd, reaped by pid */
+
+/* where a job runs: the cpus it may run on and the NUMA node its memory
+ * comes from. Masks are bit arrays, the layout of cpu_set_t */
+typedef struct placement {
+    unsigned long cpus[PLACEMENT_MAX_CPUS / (8 * sizeof(unsigned long))];
+    int hasCpus;
+    int node;          /* -1 to leave the memory policy alone */
+    int bind;          /* whether memory must come from node, or only preferably */
+    char description[128];
+} placement;
+
+/* the placement pin asked for on the line being run, or NULL */
+placement *linePlacement = NULL;
+
+/* whether background jobs go round-robin across NUMA nodes (pin --policy) */
+int roundRobinNodes = 0;
+int nextNode = 0;
+
+/* cgroup v2 directory every job gets a leaf cgroup in ($SHELL_CGROUP), -1
+ * if jobs stay in the shell's cgroup */
+int cgroupRootFd = -1;
+unsigned long cgroupsCreated = 0;  /* for unique leaf names */
+
+/* bumped whenever the shell changes its environment or working directory */
+int environGeneration = 0;
+
+/* a shell variable, exported ones are in the environment of commands */
+typedef struct variable {
+    char *entry;        /* "NAME=value", as the environment has it */
+    size_t nameLength;
+    int envIndex;       /* index in exportedEnv, -1 if not exported */
+    int changed;        /* whether its name is in changedNames */
+    struct variable *next;  /* next in the same bucket */
+} variable;
+
+variable *variables[VAR_BUCKETS];
+
+/* a variable as it was before assignments exported it for a while */
+typedef struct savedVariable {
+    char *entry;    /* copy of "NAME=value", NULL if it was unset */
+    int exported;
+} savedVariable;
+
+/* the environment of commands: the entries of the exported variables,
+ * which is environ too. Kept up to date in place as they change, rather
+ * than built for each launch */
+char **exportedEnv = NULL;
+variable **exportedVars = NULL;  /* the variable of each entry */
+int numExported = 0;
+int exportedCapacity = 0;
+
+#ifdef ZYGOTE_LAUNCHER
+/* a launch request, followed by numActions launchActions and then the
+ * command, argv and environment changes as null terminated strings */
+typedef struct launchRequest {
+    pid_t pgid;       /* like launchProcess() */
+    int foreground;
+    int argc;
+    int numActions;
+    int numChanges;   /* environment changes, "NAME=value" to set or "NAME" to unset */
+    int changeCwd;    /* whether the first fd passed is the directory to work in */
+    int execFd;       /* index into the passed fds of the executable to exec through, -1 for by path */
+} launchRequest;
+
+/* an fd of the launched process, dup2()ed from a passed fd or its own */
+typedef struct launchAction {
+    int fd;
+    int source;       /* index into the passed fds, or an fd of the process */
+    int passed;
+} launchAction;
+
+typedef struct launchReply {
+    pid_t pid;        /* 0 if it wasn't started, so the shell launches it */
+    int error;        /* errno of a failed exec, 0 if it succeeded */
+} launchReply;
+
+/* socket to the launcher, -1 when launching in the shell */
+int zygoteFd = -1;
+pid_t zygotePid = -1;         /* the launcher until it is reaped, no job's */
+int zygoteGeneration = 0;     /* environGeneration it was sent at */
+
+/* names whose environment entries changed since the launcher got them, so
+ * a sync sends only those */
+char **changedNames = NULL;
+int numChangedNames = 0;
+int changedCapacity = 0;
+#endif
+
+/* signal mask the shell started with, restored in children */
+sigset_t shellMask;
+
+/* whether input comes from a terminal, which job control hands over (and
+ * a prompt is shown). Off in -c/script mode and when stdin isn't a tty */
+int interactive = 0;
+
+/* exit status of the last command, which the shell exits with */
+int lastStatus = 0;
+
+/* whether the line being run is the last of a -c command or script, so its
+ * command can replace the shell */
+int execLastCommand = 0;
+
+/* resource usage of the last foreground job that finished, and how many
+ * have finished (so time can tell whether its command ran one) */
+struct rusage lastJobUsage;
+int finishedForegroundJobs = 0;
+
+/* set by sigintHandler, for builtins that wait without handing over the terminal */
+volatile sig_atomic_t interrupted = 0;
+
+#ifdef SERVE_MODE
+/* a connection to a --serve shell */
+typedef struct serveClient {
+    int fd;         /* the connection, -1 once the client hung up */
+    int lastId;     /* id of its last request (they are numbered from 1) */
+    int running;    /* its jobs that haven't finished yet */
+} serveClient;
+
+serveClient *serveClients = NULL;
+int numServeClients = 0;
+
+/* request id each served job answers, by job id (its client is its slot) */
+int servedIds[JOBS_CAPACITY + 1];
+
+/* the server's standard fds, put back after each request's are used, and
+ * the stdin of requests that don't pass one */
+int serveStdio[3];
+int serveNullFd = -1;
+#endif
+
+/* events the trace records, with what their pid and arg are */
+typedef enum trace_type {
+    TRACE_LINE_READ,     /* arg: length of the line */
+    TRACE_TOKENIZED,     /* arg: number of tokens */
+    TRACE_LOOKUP_HIT,    /* arg: $PATH directory of the hashed command */
+    TRACE_LOOKUP_MISS,   /* arg: $PATH directory it was found in, -1 if not found */
+    TRACE_LAUNCH_BEGIN,  /* arg: stage of the pipeline */
+    TRACE_LAUNCH_END,    /* pid: the new process (-1 if it failed), arg: errno */
+    TRACE_FORK,          /* pid: the child, which execs on its own afterwards */
+    TRACE_SPAWN,         /* pid: the child, already exec'd. arg: 1 if by the launcher */
+    TRACE_EXEC,          /* the shell execs the command itself */
+    TRACE_TCSETPGRP,     /* pid: the group given the terminal */
+    TRACE_SIGCHLD,       /* arg: number of SIGCHLDs read */
+    TRACE_STATE,         /* pid: the process, arg: its new job_state */
+    TRACE_WAIT_BEGIN,    /* pid: the foreground job's group */
+    TRACE_WAIT_END,      /* pid: its group, arg: its job_state */
+    TRACE_CLEANUP,       /* pid: group of the job freed, arg: its exit status */
+    NUM_TRACE_TYPES
+} trace_type;
+
+/* one event in the trace ring. sequence is cleared before and set after the
+ * rest is written, so a reader can tell a complete slot (sequence is its
+ * index + 1) from one being written or overwritten */
+typedef struct traceEvent {
+    unsigned long sequence;
+    long time;  /* CLOCK_MONOTONIC ns */
+    int type;
+    pid_t pid;
+    long arg;
+} traceEvent;
+
+/* the last TRACE_CAPACITY events. Slots are claimed with an atomic increment
+ * of traceHead, so events can be recorded from signal handlers too. The
+ * buffer is only mapped once tracing is first turned on, and never unmapped
+ * so a handler can't write to it after it is gone */
+traceEvent *traceBuffer = NULL;
+unsigned long traceHead = 0;
+unsigned long traceStart = 0;         /* index of the first event since trace clear */
+volatile sig_atomic_t tracing = 0;
+char *traceFile = NULL;               /* $SHELL_TRACE, the trace is written to at exit */
+
+/* records an event if tracing is on, only a (predicted) branch if it isn't */
+#define TRACE(type, pid, arg) do { \
+    if (__builtin_expect(tracing, 0)) { \
+        traceRecord(type, pid, arg); \
+    } \
+} while (0)
+
+/* bump allocator for everything belonging to one input line. Allocations
+ * that don't fit go into overflow chunks, after which reset grows the main
+ * block so the next line fits in it */
+typedef struct arenaChunk {
+    struct arenaChunk *next;
+    size_t size;  /* usable bytes after the header */
+} arenaChunk;
+
+typedef struct arena {
+    char *base;
+    size_t used;
+    size_t capacity;
+    arenaChunk *overflow;  /* chunks allocated since the last reset */
+    size_t overflowSize;   /* total usable bytes in overflow chunks */
+} arena;
+
+/* allocator for the line being executed */
+arena lineArena;
+
+/* buffered reader of input lines, from a file descriptor or from memory
+ * (a mapped script or -c string) */
+typedef struct lineReader {
+    int fd;            /* file descriptor lines are read from, -1 for memory */
+    char *prompt;      /* prompt to reprint after job notifications, or NULL */
+    char *buffer;
+    size_t start;      /* offset of first unconsumed byte */
+    size_t length;     /* offset past last byte read */
+    size_t capacity;
+    int eof;
+} lineReader;
+
+/* history file, appended to by every shell sharing it and mapped read-only.
+ * Entries are lines. For reverse search they are grouped into blocks, each
+ * with a bloom filter of the trigrams in it, so blocks that can't contain
+ * the query are skipped without looking at their entries */
+typedef struct historyBlock {
+    size_t start;  /* offset of its first entry */
+    int entries;
+    unsigned char signature[HISTORY_SIGNATURE_BITS / 8];
+} historyBlock;
+
+typedef struct history {
+    int fd;                /* opened with O_APPEND, -1 without a history file */
+    char *data;            /* the mapped file */
+    size_t mapped;         /* bytes mapped */
+    size_t length;         /* bytes up to the end of the last complete entry */
+    historyBlock *blocks;  /* built on the first search, extended as entries come in */
+    int numBlocks;
+    int blockCapacity;
+    size_t indexed;        /* bytes covered by blocks */
+    char *lastEntry;       /* last entry this shell added, to skip repeats */
+} history;
+
+history shellHistory;
+
+/* raw mode line editor for interactive input */
+typedef struct lineEditor {
+    char *prompt;
+    char *buffer;          /* line being edited */
+    size_t length;
+    size_t capacity;
+    size_t cursor;
+    char *saved;           /* edited line while browsing history (malloc'd) */
+    size_t savedLength;
+    long historyPos;       /* offset of the entry shown, -1 while editing a new line */
+    char *shownPrompt;     /* what was drawn last, to redraw after job notifications */
+    char *shownLine;
+    size_t shownLength;
+    size_t shownCursor;
+    char keys[64];         /* input read but not handled yet */
+    size_t keyStart;
+    size_t keyLength;
+    struct termios cooked; /* terminal settings to restore for commands */
+} lineEditor;
+
+/* the reader of the shell's own input (for builtins that read stdin) */
+lineReader *shellInput = NULL;
+
+/* whether a builtin is running with its stdin redirected away from it */
+int stdinRedirected = 0;
+
+/* a redirection operator (the tokenizer hands out token itself, so
+ * operators are told apart from words by pointer) */
+typedef struct redirectOperator {
+    char *token;
+    int fd;        /* fd of the command it redirects */
+    int flags;     /* open flags for the target file, -1 if it copies dupFd */
+    int dupFd;
+    int prealloc;  /* whether to reserve space for the output up front */
+} redirectOperator;
+
+/* longest first, so scanOperator() matches greedily */
+redirectOperator redirectOperators[] = {
+    { "2>&1", STDERR_FILENO, -1, STDOUT_FILENO, 0 },
+    { "2>>",  STDERR_FILENO, O_WRONLY | O_CREAT | O_APPEND, -1, 0 },
+    { "2>",   STDERR_FILENO, O_WRONLY | O_CREAT | O_TRUNC, -1, 0 },
+    { ">>",   STDOUT_FILENO, O_WRONLY | O_CREAT | O_APPEND, -1, 0 },
+    { ">|",   STDOUT_FILENO, O_WRONLY | O_CREAT | O_TRUNC, -1, 1 },
+    { ">",    STDOUT_FILENO, O_WRONLY | O_CREAT | O_TRUNC, -1, 0 },
+    { "<",    STDIN_FILENO,  O_RDONLY, -1, 0 }
+};
+
+#define NUM_REDIRECT_OPERATORS (sizeof(redirectOperators) / sizeof(redirectOperators[0]))
+
+/* the pipe operator token, a word that reads "|" is not one */
+char pipeToken[] = "|";
+
+/* one redirection of a stage, applied in order after its pipes */
+typedef struct redirection {
+    redirectOperator *op;
+    char *target;  /* file name, NULL when copying an fd */
+    int openFd;    /* target opened (close-on-exec) by openRedirections(), else -1 */
+} redirection;
+
+/* one command of a pipeline, and how to launch it */
+typedef struct stage {
+    char *command;  /* path to executable */
+    int argc;
+    char **argv;    /* NULL terminated */
+    int inFd;       /* fd to use as stdin, -1 to inherit the shell's */
+    int outFd;      /* fd to use as stdout, -1 to inherit the shell's */
+    int cgroupFd;   /* cgroup directory to start in, -1 for the shell's */
+    int execFd;     /* the executable to exec through, -1 to exec command by path */
+    placement *place;  /* cpus/node to run on, NULL to inherit the shell's */
+    char **env;     /* environment with the command's own assignments, NULL for the shell's */
+    char *searchPath;  /* $PATH given to the command alone, NULL for the shell's */
+    redirection *redirs;
+    int numRedirs;
+    pid_t pid;      /* once launched */
+} stage;
+
+/* the names in a directory, sorted for prefix lookups */
+typedef struct nameList {
+    char **names;     /* into data, directories end in '/' */
+    int numNames;
+    char *data;       /* the names back to back */
+} nameList;
+
+/* a directory read for glob expansion, kept for the rest of the line, so
+ * repeated patterns don't read it again */
+typedef struct globListing {
+    char *path;       /* as the pattern names it, "" for the working directory */
+    char **names;     /* into the line arena, each preceded by its d_type */
+    int numNames;
+    struct globListing *next;
+} globListing;
+
+/* the expansion of one line's globs, the matches of the current word */
+typedef struct globState {
+    arena *a;                 /* where listings and matches are allocated */
+    globListing *listings;
+    char **matches;
+    int numMatches;
+    int capacity;
+} globState;
+
+/* a directory in $PATH, with the mtime it had when last checked */
+typedef struct pathDir {
+    char *path;                 /* directory name ("." for empty components) */
+    int checked;                /* whether mtime has been recorded yet */
+    struct timespec mtime;      /* modification time at last check (zero if missing) */
+    struct timespec lastCheck;  /* monotonic time of last check */
+    int listed;                 /* whether executables is filled in */
+    struct timespec listedMtime;  /* mtime executables was listed at */
+    nameList executables;       /* for completion, and to skip it on misses */
+} pathDir;
+
+/* a command name resolved to an executable in one of the $PATH directories */
+typedef struct hashEntry {
+    char *name;              /* command name as typed */
+    char *path;              /* full path to executable */
+    int dir;                 /* index into pathDirs of directory it was found in */
+    int hits;                /* number of times the command was run */
+    int fd;                  /* the executable, opened once, -1 if it is exec'd by path */
+    int script;              /* whether it starts with #!, which can't be exec'd through fd */
+    dev_t dev;               /* identity of the file fd refers to */
+    ino_t ino;
+    struct timespec mtime;
+    int recheck;             /* whether its directory changed since the identity was checked */
+    struct hashEntry *next;  /* next entry in bucket */
+} hashEntry;
+
+hashEntry *commandHash[HASH_BUCKETS];
+
+/* entries dropped from the hash while a line runs, freed before the next
+ * one (its stages point at their paths and fds until then) */
+hashEntry *retiredEntries = NULL;
+int hashFds = 0;  /* entries holding an fd */
+
+/* a refcounted string, shared by everything holding the same text (the
+ * executable paths of jobs and command hash entries) */
+typedef struct internedString {
+    struct internedString *next;  /* next string in the same bucket */
+    unsigned int hash;
+    int refs;
+    char text[];                  /* what internString() hands out */
+} internedString;
+
+internedString *internTable[INTERN_BUCKETS];
+
+/* directories of the $PATH value the command hash was built for */
+char *hashedPath = NULL;
+pathDir *pathDirs = NULL;
+int numPathDirs = 0;
+int relativePathDirs = 0;  /* whether any directory is relative (depends on cwd) */
+
 /* initializes the job list */
 void initJobs();
 
-/* creates the job pointer struct with default values, is
- * essentially a constructor */
-job *createJob(char *command, char *originalCommand, pid_t pgid, job_state state, int bgProcess);
+/* creates the job pointer struct with default values (taken from the job
+ * pool), is essentially a constructor. The numProcs processes are filled in
+ * by the caller before addJob(). command must be interned */
+job *createJob(char *command, char *originalCommand, pid_t pgid, job_state state, int bgProcess, int numProcs);
 
-/* adds job to linked list of jobs */
+/* adds job to linked list of jobs, the job table and its processes to the pid hash */
 void addJob(job *j);
 
-/* marks a change in job state by pgid, called in SIGCHLD
- * handler (sigchldHandler). Usually used to  */
-int markJob(pid_t pgid, job_state state, int termSig);
+/* unlinks job from the list, job table and pid hash (doesn't free it) */
+void removeJob(job *j);
+
+/* removes a process from the pid hash (and the supervisor) */
+void removeProcess(process *p);
+
+/* finds job by job id, NULL if there is none */
+job *findJob(int id);
+
+/* finds a live process by pid (a job's leader by its pgid), NULL if there is none */
+process *findProcess(pid_t pid);
+
+/* marks a change in state of one of a job's processes by pid, adding the
+ * resources a finished process used to the job. A job is only complete once
+ * its last process is done, and then takes the state of its last stage.
+ * Called from recordStatus() */
+int markJob(pid_t pid, job_state state, int termSig, int exitCode, struct rusage *usage);
+
+/* markJob() for a process that is already known */
+void markProcess(process *p, job_state state, int termSig, int exitCode, struct rusage *usage);
+
+/* appends a finished job to the completion queue */
+void queueDoneJob(job *j);
 
-/* deletes jobs marked as completed/terminated (and outputs for signals) */
-void cleanUpJobs();
+/* marks the job of pid according to a wait status and its rusage from wait4 */
+void recordStatus(pid_t pid, int status, struct rusage *usage);
 
-/* prints all jobs */
-void printJobs();
+/* adds usage to total (taking the larger max RSS) */
+void addUsage(struct rusage *total, struct rusage *usage);
 
-/* free individual job/any malloc'd members */
+/* gives job the terminal and waits until it is done or stopped */
+void waitForJob(job *j);
+
+/* deletes the jobs in the completion queue (and outputs for signals),
+ * returns the number of notifications printed */
+int cleanUpJobs();
+
+/* exit status of a finished or stopped job, the way $? reports it in sh */
+int jobStatus(job *j);
+
+/* printJobs() flags */
+#define JOBS_DETAILS 1  /* add timing and resource usage */
+#define JOBS_RUNNING 2  /* only running jobs */
+#define JOBS_STOPPED 4  /* only stopped jobs (both: either) */
+#define JOBS_PIDS    8  /* only process group ids */
+#define JOBS_CGROUP 16  /* add live cpu/memory usage from the job's cgroup */
+
+/* prints the jobs the flags select */
+void printJobs(int flags);
+
+/* returns job to the pool, releasing its members */
 void freeJob(job *j);
 
 /* frees linked list of jobs */
 void freeAllJobs();
 
 /* performs shell cleanup, e.g sending SIGHUP/SIGCONT, calling
- * freeAllJobs() and exiting */
+ * freeAllJobs() and exiting with lastStatus */
 void cleanUpShell();
 
 /* signals */
 void safeSignal(int signum, sig_t handler);
+
+/* child state changes */
+/* sets up childEventFd (a signalfd for SIGCHLD on Linux, the read end of a
+ * self-pipe written by sigchldHandler elsewhere) */
+void initChildEvents();
+
+/* empties childEventFd, returns 1 if there were any events */
+int drainChildEvents();
+
+/* reaps every child that changed state and marks its job */
+void reapChildren();
+
+#ifdef PIDFD_SUPERVISION
+/* switches to pidfd supervision if $SHELL_PIDFD is set and pidfds work,
+ * making childEventFd an epoll fd over the pidfds and sigchldFd */
+void initSupervisor();
+
+/* opens a pidfd for a new process and adds it to the supervisor */
+void superviseProcess(process *p);
+
+/* reaps the processes whose pidfds are ready, and picks up stops */
+void superviseChildren();
+#endif
+
+#ifndef __linux__
 void sigchldHandler(int signum);
+#endif
 void sigintHandler(int signum);
 void sigtstpHandler(int signum);
 
-/* converts command line to array of tokens, removing extra whitespace */
-char **tokenize(char *input, int *numTokens, int *capacity);
+/* arena */
+void initArena(arena *a, size_t capacity);
+
+/* allocates size bytes (aligned to ARENA_ALIGN), valid until the next reset */
+void *arenaAlloc(arena *a, size_t size);
+
+/* copies length bytes of string into the arena and null terminates them */
+char *arenaCopy(arena *a, char *string, size_t length);
+
+/* frees everything allocated since the last reset, keeping the capacity */
+void resetArena(arena *a);
+
+/* input */
+/* reads from fd through a buffer of the given (initial) capacity */
+void initLineReader(lineReader *reader, int fd, char *prompt, size_t capacity);
+
+/* reads the length bytes at data, which aren't modified */
+void initMemoryReader(lineReader *reader, char *data, size_t length);
+
+/* reads a script file, mapped into memory if it is a regular file. Returns
+ * -1 (with errno set) if it can't be opened */
+int initFileReader(lineReader *reader, char *path);
+
+/* returns the next line (without its newline, and not null terminated) or
+ * NULL at end of input, and stores its length. The line is valid until the
+ * next call. While waiting for input, children that change state are reaped
+ * and finished jobs are reported */
+char *readLine(lineReader *reader, size_t *length);
+
+/* whether only whitespace is left of the input, as far as is known without
+ * reading more */
+int atEndOfInput(lineReader *reader);
+
+/* blocks until fd is readable, handling child events in the meantime */
+void waitForInput(lineReader *reader);
+
+/* reaps children and cleans up finished jobs if there were child events,
+ * returns the number of notifications printed */
+int handleChildEvents();
+
+/* line editor */
+/* sets up an editor for the terminal on stdin, returns -1 if it isn't one */
+int initEditor(lineEditor *e, char *prompt);
+
+/* reads a line from the terminal in raw mode, with editing, history and
+ * reverse search (Ctrl-R). Returns it like readLine() (an empty line after
+ * Ctrl-C), or NULL on Ctrl-D at an empty line */
+char *editLine(lineEditor *e, size_t *length);
+
+/* returns the next input byte, or -1 at end of input. Finished jobs are
+ * reported (and the line redrawn) while waiting */
+int readKey(lineEditor *e);
+
+/* redraws the prompt and the visible part of line, cursor bytes in */
+void refreshLine(lineEditor *e, char *prompt, char *line, size_t length, size_t cursor);
+
+/* replaces the edited line with length bytes of text */
+void setLine(lineEditor *e, char *text, size_t length);
+
+/* inserts a byte at the cursor */
+void insertKey(lineEditor *e, char key);
+
+/* shows an older (direction -1) or newer (1) history entry */
+void browseHistory(lineEditor *e, int direction);
+
+/* reverse incremental search, leaves the accepted entry in the editor and
+ * returns the key that ended the search (-1 if a cancel or end of input) */
+int searchMode(lineEditor *e);
+
+/* history */
+/* opens and maps the history file ($HISTFILE or ~/.shell_history) */
+void initHistory(history *h);
+
+/* maps entries other shells (or this one) appended since the last look */
+void refreshHistory(history *h);
+
+/* appends an entry to the file with a single write, under an exclusive lock */
+void addHistory(history *h, char *line, size_t length);
+
+/* start of the entry before offset, -1 if there is none */
+long previousEntry(history *h, size_t offset);
+
+/* adds the entries not covered by the search blocks yet */
+void indexHistory(history *h);
+
+/* offset of the newest entry starting before offset that contains query,
+ * -1 if there is none */
+long searchHistory(history *h, char *query, size_t queryLength, size_t offset);
+
+/* bit of a trigram in a block signature */
+unsigned int trigramBit(char *trigram);
+
+/* converts command line to a NULL terminated array of tokens, removing extra
+ * whitespace and expanding variables, then globs. Tokens point into input, which is
+ * modified in place, or (glob matches) into lineArena, which the array is
+ * allocated from too. A trailing ampersand is taken off before anything is
+ * expanded, storing whether there was one in bgProcess */
+char **tokenize(arena *lineArena, char *input, int *numTokens, int *bgProcess);
+
+/* finds the tokens of input, storing (and null terminating) them in tokens
+ * unless it is NULL. Returns the number of tokens */
+int scanTokens(char *input, char **tokens);
+
+/* returns the operator token input starts with and stores its length, NULL
+ * if it doesn't start with one */
+char *scanOperator(char *input, size_t *length);
+
+/* the redirection operator token is, NULL for other tokens */
+redirectOperator *findRedirect(char *token);
 
 /* removes ampersands and indicates whether process is to run in background */
 int handleAmpersand(char **tokens, int *numTokens);
 
+/* globs */
+/* replaces each word containing *, ? or [...] with the paths it matches
+ * (sorted, and the word itself if there are none), a redirection target
+ * only by a single match. Returns tokens if there are no globs, else a new
+ * array */
+char **expandGlobs(arena *lineArena, char **tokens, int *numTokens);
+
+/* adds the paths matching pattern (the rest of a word) in the directory
+ * prefix (prefixLength bytes, "" or ending in '/') to g's matches */
+void globPath(globState *g, char *prefix, size_t prefixLength, char *pattern);
+
+/* the names in directory path, read with getdents64 in large batches the
+ * first time the line needs them. NULL if it can't be read */
+globListing *globDirectory(globState *g, char *path);
+
+/* whether name matches length bytes of pattern (one path component) */
+int globMatch(char *pattern, size_t length, char *name);
+
+/* matches c against the [...] class pattern starts with, storing where
+ * the class ends in next. Returns -1 if the class isn't terminated */
+int matchClass(char *pattern, char *end, char c, char **next);
+
+void addMatch(globState *g, char *path);
+
 /* commands */
-/* builtins */
-void bg(char **argv, int numTokens);
-void cd(char **argv, int numTokens);
-void exitFunc(int numTokens);
-void fg(char **argv, int numTokens);
-void jobs(int numTokens);
-void killFunc(char **argv, int numTokens);
-
-/* forks process to run command in foreground/background */
-int runCommand(char *command, int argc, char **argv, int bgProcess);
-
-/* converts string to a job id, used in fg/bg/kill, with error handling */
+/* builtins, each returns its exit status */
+int bg(char **argv, int numTokens);
+int cd(char **argv, int numTokens);
+int exitFunc(char **argv, int numTokens);
+int exportFunc(char **argv, int numTokens);
+int fg(char **argv, int numTokens);
+int hash(char **argv, int numTokens);
+int jobs(char **argv, int numTokens);
+int killFunc(char **argv, int numTokens);
+int limitFunc(char **argv, int numTokens);
+int parallel(char **argv, int numTokens);
+int traceFunc(char **argv, int numTokens);
+int unsetFunc(char **argv, int numTokens);
+int waitFunc(char **argv, int numTokens);
+
+/* prefix builtins, which run the rest of the line as a command */
+int execFunc(char **argv, int numTokens, int bgProcess);
+int pinFunc(char **argv, int numTokens, int bgProcess);
+int timeFunc(char **argv, int numTokens, int bgProcess);
+
+/* builtin flags, the policies runBuiltin() applies */
+#define BUILTIN_USES_JOBS 1  /* reads job states, so pending child events are reaped first */
+#define BUILTIN_MAY_EXIT  2  /* may exit the shell, so output is flushed first */
+#define BUILTIN_RUNS_COMMANDS 4  /* assignments before it are for the commands it runs */
+
+/* switch key for findBuiltin(), unique for every builtin name */
+#define BUILTIN_KEY(length, first, last) ((length) << 16 | (first) << 8 | (last))
+
+typedef struct builtin {
+    char *name;
+    int (*func)(char **argv, int numTokens);
+    int (*prefix)(char **argv, int numTokens, int bgProcess);  /* instead of func */
+    int flags;
+} builtin;
+
+/* registry of builtins, findBuiltin() maps names to these indices */
+enum {
+    BUILTIN_BG,
+    BUILTIN_CD,
+    BUILTIN_EXEC,
+    BUILTIN_EXIT,
+    BUILTIN_EXPORT,
+    BUILTIN_FG,
+    BUILTIN_HASH,
+    BUILTIN_JOBS,
+    BUILTIN_KILL,
+    BUILTIN_LIMIT,
+    BUILTIN_PARALLEL,
+    BUILTIN_PIN,
+    BUILTIN_TIME,
+    BUILTIN_TRACE,
+    BUILTIN_UNSET,
+    BUILTIN_WAIT
+};
+
+builtin builtins[] = {
+    [BUILTIN_BG]   = { "bg",   bg,       NULL,     BUILTIN_USES_JOBS },
+    [BUILTIN_CD]   = { "cd",   cd,       NULL,     0 },
+    [BUILTIN_EXEC] = { "exec", NULL,     execFunc, BUILTIN_MAY_EXIT | BUILTIN_RUNS_COMMANDS },
+    [BUILTIN_EXIT] = { "exit", exitFunc, NULL,     BUILTIN_MAY_EXIT },
+    [BUILTIN_EXPORT] = { "export", exportFunc, NULL, 0 },
+    [BUILTIN_FG]   = { "fg",   fg,       NULL,     BUILTIN_USES_JOBS },
+    [BUILTIN_HASH] = { "hash", hash,     NULL,     0 },
+    [BUILTIN_JOBS] = { "jobs", jobs,     NULL,     BUILTIN_USES_JOBS },
+    [BUILTIN_KILL] = { "kill", killFunc, NULL,     BUILTIN_USES_JOBS },
+    [BUILTIN_LIMIT] = { "limit", limitFunc, NULL,   BUILTIN_USES_JOBS },
+    [BUILTIN_PARALLEL] = { "parallel", parallel, NULL, BUILTIN_USES_JOBS | BUILTIN_RUNS_COMMANDS },
+    [BUILTIN_PIN]  = { "pin",  NULL,     pinFunc,  BUILTIN_RUNS_COMMANDS },
+    [BUILTIN_TIME] = { "time", NULL,     timeFunc, BUILTIN_RUNS_COMMANDS },
+    [BUILTIN_TRACE] = { "trace", traceFunc, NULL,   0 },
+    [BUILTIN_UNSET] = { "unset", unsetFunc, NULL,   0 },
+    [BUILTIN_WAIT] = { "wait", waitFunc, NULL,     BUILTIN_USES_JOBS }
+};
+
+/* finds a builtin by name, NULL if there is none */
+builtin *findBuiltin(char *name);
+
+/* runs a builtin, applying the policies its flags ask for */
+int runBuiltin(builtin *b, char **argv, int numTokens, int bgProcess);
+
+/* runs a tokenized command line (a builtin or a pipeline), returns its
+ * exit status */
+int executeCommand(char **tokens, int numTokens, int bgProcess);
+
+/* seconds from start to end */
+double elapsedSeconds(struct timespec *start, struct timespec *end);
+
+/* prints a time the way the time builtin reports it */
+void printTime(char *label, double seconds);
+
+/* runs the stages of a pipeline as one job in foreground/background, argv
+ * is the whole command line (for jobs output). Returns the exit status of
+ * a foreground job, 0 for a background one */
+int runCommand(stage *stages, int numStages, int argc, char **argv, int bgProcess);
+
+/* launches the stages of a pipeline (with their redirections opened) and
+ * adds them as a job, giving it the terminal if foreground. Returns the job,
+ * or NULL (with errno set) if not even the first stage could be started */
+job *launchJob(stage *stages, int numStages, int argc, char **argv, int bgProcess, int foreground);
+
+/* replaces the shell with a resolved stage and its redirections. Only
+ * returns if that fails, with the shell as it was and the exit status */
+int execStage(stage *s);
+
+/* parallel */
+/* parses, resolves and launches one parallel task: prefix followed by input
+ * as one argument, or input as a command line if there is no prefix. Stores
+ * the job in task and returns 0, -1 if input is an empty command, or the exit
+ * status of a task that couldn't be started */
+int launchTask(arena *a, char **prefix, int prefixArgc, char *input, int inFd, job **task);
+
+/* reads the lines of the shell's stdin into one buffer of consecutive null
+ * terminated strings, returns their number */
+int readInputLines(char **data);
+
+#ifdef SERVE_MODE
+/* server mode */
+/* listens on a SOCK_SEQPACKET Unix socket at path and runs every command
+ * line sent to it as a job without the terminal, replying when it starts
+ * and when it finishes. Runs until SIGINT/SIGTERM and doesn't return */
+void serve(char *path);
+
+/* reads one request from a client (a command line, with up to three fds
+ * for its stdin/stdout/stderr) and launches it. Drops the client, hanging
+ * up its jobs, once it has hung up itself (poll said so in hungUp) and
+ * nothing is left to read */
+void serveRequest(int client, int hungUp);
+
+/* replies to the clients of served jobs that finished and frees the jobs,
+ * other finished jobs stay queued for cleanUpJobs() */
+void finishServedJobs();
+
+/* sends a reply (formatted like printf) to a client, dropped if the
+ * client hung up or isn't reading its replies */
+void sendReply(serveClient *c, const char *format, ...);
+#endif
+
+/* creates a close-on-exec pipe, enlarging its buffer to size bytes if
+ * size > 0 and the platform supports it */
+int makePipe(int fds[2], int size);
+
+/* pipe buffer size requested through $SHELL_PIPE_SIZE, 0 for the default */
+int pipeBufferSize();
+
+/* starts a stage in process group pgid (0 for a new one) with childMask as
+ * its signal mask, giving the group the terminal first if foreground. Uses
+ * posix_spawn, falling back to forkProcess() for anything spawn attributes
+ * can't express. Returns the pid, or -1 (with errno set) */
+pid_t launchProcess(stage *s, pid_t pgid, int foreground, sigset_t *childMask);
+
+/* fork/exec version of launchProcess() */
+pid_t forkProcess(stage *s, pid_t pgid, int foreground, sigset_t *childMask);
+
+#ifdef ZYGOTE_LAUNCHER
+/* zygote launcher */
+/* forks the launcher if $SHELL_ZYGOTE is set, while the shell is still small */
+void initZygote();
+
+/* has the launcher start a stage like launchProcess() does, storing the pid
+ * (-1 with errno set if the exec failed). Returns -1 if the request couldn't
+ * be made (too big, the launcher is gone or can't work in the directory), so
+ * the shell launches itself */
+int zygoteLaunch(stage *s, pid_t pgid, int foreground, pid_t *pid);
+
+/* adds the entries of changedNames (or the bare name of each that is no
+ * longer exported) to the request strings at end, returns how many there are
+ * or -1 if they don't fit before limit */
+int environChanges(char **end, char *limit);
+
+/* reaps the launcher if it exited, which the job bookkeeping doesn't */
+void reapZygote();
+
+/* the launcher's loop, serving requests on fd until the shell closes it */
+void runZygote(int fd);
+
+/* the launched process: joins its group, takes its fds and execs, writing
+ * errno to statusFd if that fails */
+void zygoteChild(launchRequest *request, launchAction *actions, int *fds, char **argv, int statusFd);
+#endif
+
+/* cgroups */
+/* opens $SHELL_CGROUP (a cgroup v2 directory, or 1 for the shell's own
+ * cgroup) and enables the cpu and memory controllers for leaves in it */
+void initCgroups();
+
+/* stores the cgroup v2 directory the shell is in, returns -1 if it isn't
+ * in one or the hierarchy isn't mounted */
+int shellCgroup(char *path, size_t size);
+
+/* makes a leaf cgroup for a new job, storing its name. Returns an fd for
+ * the directory, -1 if it couldn't be made */
+int createJobCgroup(char **name);
+
+/* removes a job's leaf cgroup (once the processes in it are gone) */
+void removeJobCgroup(char *name);
+
+/* writes value to a cgroup file relative to dirFd, returns -1 (with errno
+ * set) if that fails */
+int writeCgroup(int dirFd, char *file, char *value);
+
+/* reads a cgroup file relative to dirFd into buffer (null terminated),
+ * returns -1 if that fails */
+int readCgroup(int dirFd, char *file, char *buffer, size_t size);
+
+/* stores a job's live cpu time and memory use, as jobs -v shows them */
+void cgroupUsage(job *j, char *buffer, size_t size);
+
+#ifdef CGROUP_CLONE
+/* forks straight into the cgroup cgroupFd is a directory of */
+pid_t cloneIntoCgroup(int cgroupFd);
+#endif
+
+/* placement */
+/* the placement for a new job: what pin asked for, else the next node for
+ * a background job with round-robin on. Returns NULL for neither */
+placement *jobPlacement(int bgProcess, placement *storage);
+
+/* parses a cpu list ("0-3,8,10-11") into mask, returns -1 if it isn't one */
+int parseCpuList(char *list, unsigned long *mask);
+
+/* reads the cpus of NUMA node into place, returns -1 if there is no such node */
+int nodeCpus(int node, placement *place);
+
+/* number of NUMA nodes (1 without NUMA) */
+int numNodes();
+
+/* applies place to the calling process, in a child before exec */
+void applyPlacement(placement *place);
+
+/* splits tokens at pipe operators into stages allocated from lineArena, taking the
+ * redirections out of their arguments. Prints a syntax error and returns -1
+ * if a stage is empty or a redirection has no target, else the number of
+ * stages */
+int splitPipeline(arena *lineArena, char **tokens, int numTokens, stage **stages);
+
+/* opens the files the stages redirect to, printing an error (and closing
+ * what was opened) and returning -1 if one can't be opened */
+int openRedirections(stage *stages, int numStages);
+
+/* closes the files opened by openRedirections() */
+void closeRedirections(stage *stages, int numStages);
+
+/* reserves $SHELL_PREALLOC_SIZE bytes for output to fd without changing its
+ * size, best effort */
+void preallocateOutput(int fd);
+
+/* points the shell's own fds where a builtin's redirections say, saving the
+ * originals in saved (one per redirection). Returns -1 on failure */
+int applyRedirections(stage *s, int *saved);
+
+/* undoes applyRedirections() */
+void restoreRedirections(stage *s, int *saved);
+
+/* finds the executable of each stage, printing an error and returning -1 if
+ * one can't be found */
+int resolveStages(stage *stages, int numStages);
+
+/* converts string (%n) to a job id, used in wait and limit. Returns -1 if
+ * it isn't one, or names a job past the end of the job table */
 int stringToJobId(char *string);
 
+/* what parseTargets() accepts besides %n and %a-%b */
+#define TARGETS_STATES 1  /* --all, --running and --stopped */
+#define TARGETS_PIDS   2  /* plain pids */
+
+/* the jobs (and pids) the operands of bg/fg/kill name */
+typedef struct targetSet {
+    job **jobs;   /* each job once, in the order named */
+    int numJobs;
+    pid_t *pids;
+    int numPids;
+} targetSet;
+
+/* resolves operands into set (allocated from lineArena) with direct job
+ * table lookups and at most one walk of the job list. Prints an error
+ * prefixed with name and returns -1 if an operand is invalid or names no job */
+int parseTargets(char *name, char **operands, int numOperands, int accept, targetSet *set);
+
+/* converts a signal name (TERM, SIGTERM, term) or number to a signal
+ * number, -1 if it isn't one */
+int parseSignal(char *string);
+
 /* joins array of strings into new string separated by spaces */
 char *joinString(int argc, char **argv);
 
 /* checks if file exists and is executable */
 int fileExists(char *filename);
 
+/* command hash */
+/* resolves a command name to an entry in the command hash, searching $PATH
+ * on a miss. Returns NULL if the command could not be found */
+hashEntry *resolveCommand(char *name);
+
+/* rebuilds pathDirs if $PATH changed since the last lookup */
+void updatePathDirs();
+
+/* stats a $PATH directory (at most once every HASH_RECHECK_INTERVAL), returns
+ * 1 if its mtime changed since the last check */
+int pathDirChanged(int dir);
+
+/* handles a change in directory fromDir: removes the hashed commands found
+ * in a later one, which a new file there could shadow, and has the ones
+ * found in it checked against their files again when next looked up */
+void invalidateCommandHash(int fromDir);
+
+/* removes every entry from the command hash */
+void clearCommandHash();
+
+/* opens the executable at path (if it is one) and stores the fd and its
+ * identity in entry, returns -1 if it isn't an executable file. Only fills
+ * in the identity once HASH_MAX_FDS entries hold an fd */
+int openExecutable(char *path, hashEntry *entry);
+
+/* compares a hashed command's identity (dev/ino/mtime) with its file,
+ * opening it again if it was replaced. Returns -1 if it is gone */
+int checkHashEntry(hashEntry *entry);
+
+/* moves an entry out of the hash, to be freed by freeRetiredEntries() */
+void retireHashEntry(hashEntry *entry);
+
+/* frees the entries dropped from the hash while the last line ran */
+void freeRetiredEntries();
+
+/* the executables in a $PATH directory, listed again if its mtime changed */
+nameList *pathExecutables(int dir);
+
+/* reads the names in a directory in one getdents64 pass and sorts them,
+ * only executable files if executablesOnly. Returns -1 if it can't be read */
+int listDirectory(char *path, int executablesOnly, nameList *list);
+
+/* reads directory entries into buffer, returns the bytes read (0 at the end) */
+ssize_t readEntries(DIR *dir, int fd, char *buffer, size_t size);
+
+int compareNames(const void *a, const void *b);
+
+/* frees what listDirectory() filled in */
+void freeNames(nameList *list);
+
+/* index of the first name in list not sorting before prefix */
+int findPrefix(nameList *list, char *prefix, size_t length);
+
+/* completes the word before the cursor, a command name for the first word
+ * of a pipeline stage and a file name otherwise. Lists the candidates when
+ * the word can't be extended */
+void completeWord(lineEditor *e);
+
+/* appends the names in list starting with prefix to candidates (grown as
+ * needed), returns the new number of candidates. Hidden names need a prefix */
+int addCandidates(nameList *list, char *prefix, size_t length, char ***candidates, int numCandidates, int *capacity);
+
+/* prints candidates in columns below the line */
+void listCandidates(char **candidates, int numCandidates);
+
+/* hash function for command names */
+unsigned int hashString(char *string);
+
+/* interned strings */
+/* returns the interned copy of string, adding a reference to it */
+char *internString(char *string);
+
+/* drops a reference to an interned string, freeing it with the last one */
+void releaseString(char *string);
+
+/* variables */
+/* fills the variable table from the environment the shell got, all of it
+ * exported, and makes exportedEnv the environment */
+void initVariables();
+
+/* the variable named by length bytes of name, NULL if it is unset */
+variable *findVariable(char *name, size_t length);
+
+/* value of a variable, NULL if it is unset */
+char *variableValue(char *name);
+
+/* sets a variable, exporting it if export is set (an exported one stays
+ * exported either way) */
+void setVariable(char *name, size_t nameLength, char *value, int export);
+
+/* adds a variable to exportedEnv or takes it out */
+void exportVariable(variable *v, int export);
+
+/* notes that the environment entry of v changed, for the launcher */
+void environEntryChanged(variable *v);
+
+void unsetVariable(char *name, size_t nameLength);
+
+/* exports count NAME=value assignments until restoreVariables(), returning
+ * what they replace (allocated from a) */
+savedVariable *exportAssignments(arena *a, char **assignments, int count);
+
+/* puts back the variables exportAssignments() replaced */
+void restoreVariables(char **assignments, savedVariable *saved, int count);
+
+/* length of the valid variable name name starts with, 0 if none */
+size_t variableNameLength(char *name);
+
+/* length of NAME if word is a NAME=value assignment, else 0 */
+size_t assignmentName(char *word);
+
+/* the environment with count NAME=value assignments merged in, sharing
+ * its entries. Allocated from a */
+char **overrideEnvironment(arena *a, char **assignments, int count);
+
+/* expands $NAME, ${NAME}, $? and $$ in tokens, dropping words that expand
+ * to nothing. Expanded words are allocated from a, returns the new number
+ * of tokens */
+int expandVariables(arena *a, char **tokens, int numTokens);
+
+/* writes word with its variables expanded to result (unless it is NULL),
+ * returns the length */
+size_t expandWord(char *word, char *result);
+
+/* finds an executable name in the directories of path (not through the
+ * command hash), returns the path allocated from lineArena or NULL */
+char *searchPath(char *name, char *path);
+
+/* hash function for variable names */
+unsigned int hashName(char *name, size_t length);
+
+/* event trace */
+/* turns tracing on if $SHELL_TRACE names a file to write the trace to at exit */
+void initTrace();
+
+/* maps the trace buffer (the first time) and turns tracing on, returns -1
+ * if the buffer can't be mapped */
+int startTrace();
+
+/* adds an event to the trace ring, async-signal-safe */
+void traceRecord(int type, pid_t pid, long arg);
+
+/* writes the events in the ring to path ("-" for stdout) as JSON lines, or
+ * in Chrome's trace event format if chrome is set. Returns -1 if path can't
+ * be written */
+int dumpTrace(char *path, int chrome);
+
+/* whether a trace written to path should be in Chrome's format (*.json) */
+int chromeTracePath(char *path);
+
 int main(int argc, char **argv) {
     int running = 1;
+    lineReader reader;
+    lineEditor editor;
+    int editing = 0;
+#ifdef SERVE_MODE
+    char *servePath = NULL;
+#endif
+
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        /* shell -c "command" */
+        if (argc < 3) {
+            puts("shell: -c: option requires an argument");
+            return 2;
+        }
+        initMemoryReader(&reader, argv[2], strlen(argv[2]));
+    } else if (argc > 1 && strcmp(argv[1], "--serve") == 0) {
+        /* shell --serve socket, commands come in over the socket */
+        if (argc < 3) {
+            puts("shell: --serve: option requires an argument");
+            return 2;
+        }
+#ifdef SERVE_MODE
+        servePath = argv[2];
+        initMemoryReader(&reader, "", 0);
+#else
+        puts("shell: --serve: not supported on this platform");
+        return 2;
+#endif
+    } else if (argc > 1) {
+        /* shell script */
+        if (initFileReader(&reader, argv[1]) < 0) {
+            printf("shell: %s: %s\n", argv[1], strerror(errno));
+            return 127;
+        }
+    } else {
+        interactive = isatty(STDIN_FILENO);
+        initLineReader(&reader, STDIN_FILENO, interactive ? "> " : NULL,
+                interactive ? TTY_BUFFER_SIZE : READ_BUFFER_SIZE);
+    }
+
+    shellInput = &reader;
+
+    /* the shell's own output is flushed explicitly, once per prompt cycle
+     * and before anything else can write to the terminal */
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+    initVariables();
+
+#ifdef ZYGOTE_LAUNCHER
+    /* before anything the launcher has no use for is set up */
+    initZygote();
+#endif
+    initCgroups();
+    initTrace();
+
     initJobs();
+    initChildEvents();
+    initArena(&lineArena, ARENA_MIN_SIZE);
+
+    if (interactive && initEditor(&editor, "> ") == 0) {
+        editing = 1;
+    }
 
-    safeSignal(SIGCHLD, sigchldHandler);
     safeSignal(SIGINT, sigintHandler);
     safeSignal(SIGTSTP, sigtstpHandler);
 
+    /* so the shell can hand the terminal back and forth (children get the
+     * default action again) */
+    signal(SIGTTOU, SIG_IGN);
+
+#ifdef SERVE_MODE
+    if (servePath != NULL) {
+        serve(servePath);
+    }
+#endif
+
     while (running) {
-        char *input = NULL;
+        char *input;
+        size_t inputLength;
         char **tokens;
         int numTokens;
-        int i;
-        size_t bufferLength = 0;
-        int charsRead;
-        int capacity;
         int bgProcess = 0;
-        char *command;
-        
-        printf("> ");
+
+        resetArena(&lineArena);
+        freeRetiredEntries();
+
+        if (interactive && !editing) {
+            printf("> ");
+        }
+
+        /* everything the last command printed goes out in one write */
+        fflush(stdout);
 
         /* read input command */
-        charsRead = getline(&input, &bufferLength, stdin);
+        input = editing ? editLine(&editor, &inputLength) : readLine(&reader, &inputLength);
 
-        if (charsRead == -1) {
-            free(input);
+        if (input == NULL) {
             break;
         }
+        TRACE(TRACE_LINE_READ, 0, inputLength);
 
-        cleanUpJobs();
-
-        /* Remove trailing newline */
-        input[--charsRead] = '\0';
-        
-        if (charsRead == 0) {
+        if (inputLength == 0) {
             /* user typed an empty line */
-            free(input);
             continue;
         }
 
         /* Break line into individual tokens */
-        tokens = tokenize(input, &numTokens, &capacity);
-        bgProcess = handleAmpersand(tokens, &numTokens);
+        input = arenaCopy(&lineArena, input, inputLength);
+        tokens = tokenize(&lineArena, input, &numTokens, &bgProcess);
+        TRACE(TRACE_TOKENIZED, 0, numTokens);
 
         if (numTokens == 0) {
             /* user typed line of only whitespace */
-            free(tokens);
-            free(input);
             continue;
         }
 
-        if (numTokens == capacity) {
-            capacity += COMMAND_LENGTH;
-            tokens = realloc(tokens, capacity * sizeof(char*));
-        }
-        tokens[numTokens] = NULL;
-
-        command = strdup(tokens[0]);
-
-        /* relative or absolute filepath */
-        if (command[0] == '.' || command[0] == '/') {
-            if (fileExists(command)) {
-                runCommand(command, numTokens, tokens, bgProcess);
-            } else {
-                printf("%s: No such file or directory\n", command);
-            }
-        } else {
-            /* direct command name */
-            sigset_t maskOne, prevOne;
-
-            sigemptyset(&maskOne);
-            sigaddset(&maskOne, SIGCHLD);
-
-            sigprocmask(SIG_BLOCK, &maskOne, &prevOne);
-
-            /* builtins */
-            if (strcmp(command, "bg") == 0) {
-                bg(tokens, numTokens);
-                sigprocmask(SIG_SETMASK, &prevOne, NULL);
-            } else if (strcmp(command, "fg") == 0) {
-                fg(tokens, numTokens);
-                sigprocmask(SIG_SETMASK, &prevOne, NULL);
-            } else if (strcmp(command, "cd") == 0) {
-                sigprocmask(SIG_SETMASK, &prevOne, NULL);
-                cd(tokens, numTokens);
-            } else if (strcmp(command, "jobs") == 0) {
-                jobs(numTokens);
-                sigprocmask(SIG_SETMASK, &prevOne, NULL);
-            } else if (strcmp(command, "kill") == 0) {
-                killFunc(tokens, numTokens);
-                sigprocmask(SIG_SETMASK, &prevOne, NULL);
-            } else if (strcmp(command, "exit") == 0) {
-                sigprocmask(SIG_SETMASK, &prevOne, NULL);
-                for (i = 0; i < numTokens; i++) {
-                    free(tokens[i]);
-                }
-
-                free(command);
-                free(tokens);
-                free(input);
-                break;
-            } else {
-                /* check /bin and /usr/bin in that order */
-                int result;
-                int commandLength = strlen(command);
-                char *binPrefix = malloc((5 + commandLength + 1) * sizeof(char));
-                char *usrBinPrefix = malloc((9 + commandLength + 1) * sizeof(char));
-
-                sigprocmask(SIG_SETMASK, &prevOne, NULL);
-
-                sprintf(binPrefix, "/bin/%s", command);
-                sprintf(usrBinPrefix, "/usr/bin/%s", command);
-
-                if (fileExists(binPrefix)) {
-                    result = runCommand(binPrefix, numTokens, tokens, bgProcess);
-                } else if (fileExists(usrBinPrefix)) {
-                    result = runCommand(usrBinPrefix, numTokens, tokens, bgProcess);
-                } else {
-                    printf("%s: command not found\n", command);
-                }
-
-                free(usrBinPrefix);
-                free(binPrefix);
-            }
+        if (editing) {
+            addHistory(&shellHistory, editor.buffer, editor.length);
         }
 
+        execLastCommand = !interactive && atEndOfInput(&reader);
 
-        for (i = 0; i < numTokens; i++) {
-            free(tokens[i]);
-        }
-
-        free(command);
-        free(tokens);
-        free(input);
+        lastStatus = executeCommand(tokens, numTokens, bgProcess);
 
         cleanUpJobs();
     }
@@ -248,10 +1399,28 @@ int main(int argc, char **argv) {
 
 void initJobs() {
     jobListHead = NULL;
+    jobListTail = NULL;
+    freeJobs = NULL;
+    jobPoolUsed = 0;
+    doneHead = NULL;
+    doneTail = NULL;
+    activeJobs = 0;
+    memset(jobTable, 0, sizeof(jobTable));
+    memset(finishedStatus, -1, sizeof(finishedStatus));
+    memset(pidHash, 0, sizeof(pidHash));
 }
 
-job *createJob(char *command, char *originalCommand, pid_t pgid, job_state state, int bgProcess) {
-    job *j = malloc(sizeof(job));
+job *createJob(char *command, char *originalCommand, pid_t pgid, job_state state, int bgProcess, int numProcs) {
+    job *j;
+    int i;
+
+    /* activeJobs stays below JOBS_CAPACITY, so the pool can't run out */
+    if (freeJobs != NULL) {
+        j = freeJobs;
+        freeJobs = j->next;
+    } else {
+        j = &jobPool[jobPoolUsed++];
+    }
 
     if (activeJobs == 0) {
         nextJobId = 1;
@@ -259,166 +1428,412 @@ job *createJob(char *command, char *originalCommand, pid_t pgid, job_state state
         nextJobId++;
     }
 
+    /* wrap around to the first free slot once ids run past the table */
+    if (nextJobId > JOBS_CAPACITY) {
+        nextJobId = 1;
+    }
+    while (jobTable[nextJobId] != NULL) {
+        nextJobId = nextJobId % JOBS_CAPACITY + 1;
+    }
+
     j->id = nextJobId;
+    finishedStatus[j->id] = -1;
     j->command = command;
     j->originalCommand = originalCommand;
     j->pgid = pgid;
     j->state = state;
     j->bgProcess = bgProcess;
     j->termSig = -1;
+    j->exitCode = 0;
+    clock_gettime(CLOCK_MONOTONIC, &j->startTime);
+    memset(&j->endTime, 0, sizeof(j->endTime));
+    memset(&j->usage, 0, sizeof(j->usage));
+    j->slot = -1;
+    j->waited = 0;
+    j->cgroup = NULL;
+    j->placement = NULL;
+    j->procs = numProcs == 1 ? &j->inlineProc : malloc(numProcs * sizeof(process));
+    j->numProcs = numProcs;
+    j->liveProcs = numProcs;
     j->next = NULL;
+    j->prev = NULL;
+    j->doneNext = NULL;
+
+    for (i = 0; i < numProcs; i++) {
+        j->procs[i].pid = 0;
+        j->procs[i].state = RUNNING;
+        j->procs[i].termSig = -1;
+        j->procs[i].exitCode = 0;
+        j->procs[i].job = j;
+        j->procs[i].pidNext = NULL;
+        j->procs[i].pidfd = -1;
+    }
 
     return j;
 }
 
 void addJob(job *j) {
+    int i;
+
     activeJobs++;
     if (jobListHead == NULL) {
         jobListHead = jobListTail = j;
     } else {
+        j->prev = jobListTail;
         jobListTail->next = j;
         jobListTail = j;
     }
-}
 
-int markJob(pid_t pgid, job_state state, int termSig) {
-    job *previous;
-    job *current = jobListHead;
+    jobTable[j->id] = j;
 
-    while (current != NULL && current->pgid != pgid) {
-        previous = current;
-        current = current->next;
-    }
+    for (i = 0; i < j->numProcs; i++) {
+        process **bucket = &pidHash[j->procs[i].pid & (PID_BUCKETS - 1)];
 
-    if (current == NULL) {
-        return -1;
-    }
+        j->procs[i].pidNext = *bucket;
+        *bucket = &j->procs[i];
 
-    current->state = state;
-    if (current->state == TERMINATED) {
-        current->termSig = termSig;
+#ifdef PIDFD_SUPERVISION
+        if (supervisorFd >= 0) {
+            superviseProcess(&j->procs[i]);
+        }
+#endif
     }
-    return 0;
 }
 
-void cleanUpJobs() {
-    sigset_t maskOne, prevOne;
+void removeJob(job *j) {
+    int i;
 
-    sigemptyset(&maskOne);
-    sigaddset(&maskOne, SIGCHLD);
-    sigprocmask(SIG_BLOCK, &maskOne, &prevOne);
+    for (i = 0; i < j->numProcs; i++) {
+        if (j->procs[i].state == RUNNING) {
+            removeProcess(&j->procs[i]);
+        }
+    }
 
-    job *previous = NULL;
-    job *current = jobListHead;
+    jobTable[j->id] = NULL;
 
-    while (current != NULL) {
-        if (current->state == COMPLETED || current->state == TERMINATED) {
-            if (current->state == TERMINATED) {
-                printf("[%d] %d terminated by signal %d\n", current->id, current->pgid, current->termSig);
-            }
-            /* deleting first node */
-            if (previous == NULL) {
-                job *temp = current->next;
-                freeJob(current);
-                jobListHead = current = temp;
-            } else {
-                previous->next = current->next;
-                freeJob(current);
-                current = previous->next;
-            }
-            activeJobs--;
-        } else {
-            previous = current;
-            current = current->next;
-        }
+    if (j->prev == NULL) {
+        jobListHead = j->next;
+    } else {
+        j->prev->next = j->next;
     }
 
-    jobListTail = previous;
+    if (j->next == NULL) {
+        jobListTail = j->prev;
+    } else {
+        j->next->prev = j->prev;
+    }
 
-    sigprocmask(SIG_SETMASK, &prevOne, NULL);
+    activeJobs--;
 }
 
-void cleanUpShell() {
-    job *current = jobListHead;
-    sigset_t maskOne, prevOne;
-
-    sigemptyset(&maskOne);
-    sigaddset(&maskOne, SIGCHLD);
-    sigprocmask(SIG_BLOCK, &maskOne, &prevOne);
+void removeProcess(process *p) {
+    process **link = &pidHash[p->pid & (PID_BUCKETS - 1)];
 
-    while (current != NULL) {
-        if (current->state == STOPPED) {
-            if (kill(current->pgid, SIGHUP) < 0) {
-                puts("SIGHUP failed");
-                current = current->next;
-                continue;
-            }
+    while (*link != p) {
+        link = &(*link)->pidNext;
+    }
+    *link = p->pidNext;
+
+    /* closing the pidfd also takes it out of the epoll set */
+    if (p->pidfd >= 0) {
+        close(p->pidfd);
+        p->pidfd = -1;
+    } else if (supervisorFd >= 0) {
+        untrackedProcs--;
+    }
+}
 
-            if (kill(current->pgid, SIGCONT) < 0) {
-                puts("SIGCONT failed");
-                current = current->next;
-                continue;
-            }
-        } else if (current->state == RUNNING) {
-            if (kill(current->pgid, SIGHUP) < 0) {
-                puts("SIGHUP failed");
-                current = current->next;
-                continue;
-            }
-        }
-        current = current->next;
+job *findJob(int id) {
+    if (id < 1 || id > JOBS_CAPACITY) {
+        return NULL;
     }
 
-    freeAllJobs();
-    exit(0);
+    return jobTable[id];
+}
+
+process *findProcess(pid_t pid) {
+    process *current = pidHash[pid & (PID_BUCKETS - 1)];
 
-    sigprocmask(SIG_SETMASK, &prevOne, NULL);
+    while (current != NULL && current->pid != pid) {
+        current = current->pidNext;
+    }
+
+    return current;
 }
 
-void printJobs() {
-    job *current = jobListHead;
+int markJob(pid_t pid, job_state state, int termSig, int exitCode, struct rusage *usage) {
+    process *p = findProcess(pid);
 
-    while (current != NULL) {
-        printf("[%d] %d ", current->id, current->pgid);
+    if (p == NULL) {
+        return -1;
+    }
 
-        if (current->state == RUNNING) {
-            printf("Running ");
-        } else if (current->state == STOPPED) {
-            printf("Stopped ");
-        }
+    markProcess(p, state, termSig, exitCode, usage);
+    return 0;
+}
 
-        printf("%s ", current->originalCommand);
+void markProcess(process *p, job_state state, int termSig, int exitCode, struct rusage *usage) {
+    job *current = p->job;
 
-        if (current->bgProcess) {
-            printf("&");
-        }
+    TRACE(TRACE_STATE, p->pid, state);
 
-        puts("");
+    if (state == STOPPED) {
+        current->state = STOPPED;
+        return;
+    }
 
-        current = current->next;
+    /* done, drop it from the hash right away so a reused pid can't match it */
+    p->state = state;
+    p->termSig = termSig;
+    p->exitCode = exitCode;
+    removeProcess(p);
+    addUsage(&current->usage, usage);
+
+    if (--current->liveProcs == 0) {
+        process *last = &current->procs[current->numProcs - 1];
+
+        clock_gettime(CLOCK_MONOTONIC, &current->endTime);
+        current->state = last->state;
+        current->exitCode = last->exitCode;
+        if (current->state == TERMINATED) {
+            current->termSig = last->termSig;
+        }
+        queueDoneJob(current);
     }
 }
 
-void freeJob(job *j) {
-    free(j->command);
-    free(j->originalCommand);
-    free(j);
-}
+void queueDoneJob(job *j) {
+    j->doneNext = NULL;
 
-void freeAllJobs() {
-    job *current = jobListHead;
-    
-    while (current != NULL) {
-        job *next = current->next;
-        freeJob(current);
-        current = next;
+    if (doneTail == NULL) {
+        doneHead = j;
+    } else {
+        doneTail->doneNext = j;
     }
-
-    jobListHead = NULL;
+    doneTail = j;
 }
 
-void safeSignal(int signum, sig_t handler) {
-    struct sigaction sa;
+void recordStatus(pid_t pid, int status, struct rusage *usage) {
+    if (WIFEXITED(status)) {
+        /* exited normally */
+        markJob(pid, COMPLETED, -1, WEXITSTATUS(status), usage);
+    }
+
+    if (WIFSTOPPED(status)) {
+        /* user pressed Ctrl-Z */
+        markJob(pid, STOPPED, -1, 0, usage);
+    }
+
+    if (WIFSIGNALED(status)) {
+        /* exited with some unhandled signal */
+        markJob(pid, TERMINATED, WTERMSIG(status), 0, usage);
+    }
+}
+
+void addUsage(struct rusage *total, struct rusage *usage) {
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+
+    if (usage->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+
+    total->ru_minflt += usage->ru_minflt;
+    total->ru_majflt += usage->ru_majflt;
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+int jobStatus(job *j) {
+    if (j->state == TERMINATED) {
+        return 128 + j->termSig;
+    }
+
+    if (j->state == STOPPED) {
+        return 128 + SIGTSTP;
+    }
+
+    return j->exitCode;
+}
+
+void waitForJob(job *j) {
+    int status;
+    struct rusage usage;
+    pid_t wpid;
+
+    TRACE(TRACE_WAIT_BEGIN, j->pgid, 0);
+    if (interactive) {
+        tcsetpgrp(STDIN_FILENO, j->pgid);
+        TRACE(TRACE_TCSETPGRP, j->pgid, 0);
+    }
+
+    while (j->liveProcs > 0 && j->state != STOPPED) {
+        wpid = wait4(-j->pgid, &status, WUNTRACED, &usage);
+
+        if (wpid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            puts(strerror(errno));
+            break;
+        }
+
+        recordStatus(wpid, status, &usage);
+    }
+
+    if (interactive) {
+        tcsetpgrp(STDIN_FILENO, getpgid(getpid()));
+        TRACE(TRACE_TCSETPGRP, getpgid(getpid()), 0);
+    }
+    TRACE(TRACE_WAIT_END, j->pgid, j->state);
+
+    if (j->liveProcs == 0) {
+        lastJobUsage = j->usage;
+        finishedForegroundJobs++;
+    }
+}
+
+int cleanUpJobs() {
+    int notifications = 0;
+
+    while (doneHead != NULL) {
+        job *current = doneHead;
+
+        doneHead = current->doneNext;
+
+        if (current->state == TERMINATED) {
+            printf("[%d] %d terminated by signal %d\n", current->id, current->pgid, current->termSig);
+            notifications++;
+        }
+        finishedStatus[current->id] = jobStatus(current);
+        TRACE(TRACE_CLEANUP, current->pgid, finishedStatus[current->id]);
+        removeJob(current);
+        freeJob(current);
+    }
+    doneTail = NULL;
+
+    return notifications;
+}
+
+void cleanUpShell() {
+    job *current = jobListHead;
+
+    while (current != NULL) {
+        if (current->state == STOPPED) {
+            if (kill(-current->pgid, SIGHUP) < 0) {
+                puts("SIGHUP failed");
+                current = current->next;
+                continue;
+            }
+
+            if (kill(-current->pgid, SIGCONT) < 0) {
+                puts("SIGCONT failed");
+                current = current->next;
+                continue;
+            }
+        } else if (current->state == RUNNING) {
+            if (kill(-current->pgid, SIGHUP) < 0) {
+                puts("SIGHUP failed");
+                current = current->next;
+                continue;
+            }
+        }
+        current = current->next;
+    }
+
+    if (traceFile != NULL) {
+        dumpTrace(traceFile, chromeTracePath(traceFile));
+    }
+
+    freeAllJobs();
+    clearCommandHash();
+    freeRetiredEntries();
+    exit(lastStatus);
+}
+
+void printJobs(int flags) {
+    job *current;
+    struct timespec now;
+    int states = flags & (JOBS_RUNNING | JOBS_STOPPED);
+
+    if (flags & JOBS_DETAILS) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+
+    /* one printf per job, the output is only written once the prompt is */
+    for (current = jobListHead; current != NULL; current = current->next) {
+        char *state = "";
+        char usage[PATH_MAX + 64] = "";
+
+        if (states != 0 && !((states & JOBS_RUNNING) && current->state == RUNNING)
+                && !((states & JOBS_STOPPED) && current->state == STOPPED)) {
+            continue;
+        }
+
+        if (flags & JOBS_PIDS) {
+            printf("%d\n", current->pgid);
+            continue;
+        }
+
+        if (current->state == RUNNING) {
+            state = "Running ";
+        } else if (current->state == STOPPED) {
+            state = "Stopped ";
+        }
+
+        /* read live, unlike the usage of finished processes */
+        if ((flags & JOBS_CGROUP) && current->cgroup != NULL) {
+            cgroupUsage(current, usage, sizeof(usage));
+        }
+
+        if (flags & JOBS_DETAILS) {
+            /* cpu time and max RSS only count processes that finished */
+            struct timespec *end = current->liveProcs == 0 ? &current->endTime : &now;
+            struct timeval cpu;
+
+            timeradd(&current->usage.ru_utime, &current->usage.ru_stime, &cpu);
+            printf("[%d] %d %s%s %s wall %.3fs cpu %.3fs maxrss %ldKB%s%s%s\n",
+                    current->id, current->pgid, state, current->originalCommand,
+                    current->bgProcess ? "&" : "", elapsedSeconds(&current->startTime, end),
+                    cpu.tv_sec + cpu.tv_usec / 1e6, current->usage.ru_maxrss,
+                    current->placement != NULL ? " pin " : "",
+                    current->placement != NULL ? current->placement : "", usage);
+        } else {
+            printf("[%d] %d %s%s %s%s\n", current->id, current->pgid, state,
+                    current->originalCommand, current->bgProcess ? "&" : "", usage);
+        }
+    }
+}
+
+void freeJob(job *j) {
+    releaseString(j->command);
+    free(j->originalCommand);
+    if (j->cgroup != NULL) {
+        removeJobCgroup(j->cgroup);
+    }
+    free(j->placement);
+    if (j->procs != &j->inlineProc) {
+        free(j->procs);
+    }
+
+    j->next = freeJobs;
+    freeJobs = j;
+}
+
+void freeAllJobs() {
+    job *current = jobListHead;
+    
+    while (current != NULL) {
+        job *next = current->next;
+        freeJob(current);
+        current = next;
+    }
+
+    initJobs();
+}
+
+void safeSignal(int signum, sig_t handler) {
+    struct sigaction sa;
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = SA_RESTART;
     sa.sa_handler = handler;
@@ -426,387 +1841,5711 @@ void safeSignal(int signum, sig_t handler) {
     sigaction(signum, &sa, NULL);
 }
 
-void sigchldHandler(int signum) {
-    int oldErrno = errno;
-    sigset_t maskAll, prevAll;
+void initChildEvents() {
+    sigset_t maskOne;
+
+    sigemptyset(&maskOne);
+    sigaddset(&maskOne, SIGCHLD);
+
+#ifdef __linux__
+    /* SIGCHLD stays blocked and is only ever read from the signalfd */
+    sigprocmask(SIG_BLOCK, &maskOne, &shellMask);
+    sigchldFd = signalfd(-1, &maskOne, SFD_NONBLOCK | SFD_CLOEXEC);
+#else
+    sigprocmask(SIG_BLOCK, NULL, &shellMask);
+
+    pipe(childEventPipe);
+    fcntl(childEventPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(childEventPipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(childEventPipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(childEventPipe[1], F_SETFD, FD_CLOEXEC);
+    sigchldFd = childEventPipe[0];
+
+    safeSignal(SIGCHLD, sigchldHandler);
+#endif
+    childEventFd = sigchldFd;
+
+#ifdef PIDFD_SUPERVISION
+    initSupervisor();
+#endif
+}
+
+int drainChildEvents() {
+#ifdef __linux__
+    struct signalfd_siginfo info[16];
+#else
+    char info[64];
+#endif
+    int events = 0;
+    ssize_t bytesRead;
+
+    while ((bytesRead = read(sigchldFd, info, sizeof(info))) > 0) {
+        events = 1;
+#ifdef __linux__
+        TRACE(TRACE_SIGCHLD, 0, bytesRead / sizeof(info[0]));
+#endif
+    }
+
+#ifdef PIDFD_SUPERVISION
+    if (supervisorFd >= 0) {
+        struct pollfd fds = { supervisorFd, POLLIN, 0 };
+
+        if (poll(&fds, 1, 0) > 0) {
+            events = 1;
+        }
+    }
+#endif
+
+    return events;
+}
+
+void reapChildren() {
     int status;
+    struct rusage usage;
     pid_t pid;
 
-    sigfillset(&maskAll);
+#ifdef ZYGOTE_LAUNCHER
+    reapZygote();
+#endif
+
+#ifdef PIDFD_SUPERVISION
+    if (supervisorFd >= 0) {
+        superviseChildren();
+
+        /* processes that didn't get a pidfd have to be found by pid */
+        if (untrackedProcs == 0) {
+            return;
+        }
+    }
+#endif
+
+    while ((pid = wait4(-1, &status, WUNTRACED | WNOHANG, &usage)) > 0) {
+#ifdef ZYGOTE_LAUNCHER
+        /* its pid mustn't be waited for again once another child may have it */
+        if (pid == zygotePid) {
+            zygotePid = -1;
+            continue;
+        }
+#endif
+        recordStatus(pid, status, &usage);
+    }
+}
+
+#ifdef PIDFD_SUPERVISION
+void initSupervisor() {
+    char *value = getenv("SHELL_PIDFD");
+    struct epoll_event event;
+    struct rlimit limit;
+    int fd;
+
+    if (value == NULL || value[0] == '\0' || strcmp(value, "0") == 0) {
+        return;
+    }
+
+    /* the kernel needs pidfd_open, and waitid(P_PIDFD) which came after it */
+    if ((fd = syscall(SYS_pidfd_open, getpid(), 0)) < 0) {
+        return;
+    }
+    close(fd);
+
+    if ((supervisorFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        return;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(supervisorFd, EPOLL_CTL_ADD, sigchldFd, &event);
+    childEventFd = supervisorFd;
+
+    /* one fd per live process */
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+void superviseProcess(process *p) {
+    struct epoll_event event;
+
+    /* pidfds are always close-on-exec */
+    p->pidfd = syscall(SYS_pidfd_open, p->pid, 0);
+
+    if (p->pidfd >= 0) {
+        event.events = EPOLLIN;
+        event.data.ptr = p;
+
+        if (epoll_ctl(supervisorFd, EPOLL_CTL_ADD, p->pidfd, &event) == 0) {
+            return;
+        }
+        close(p->pidfd);
+        p->pidfd = -1;
+    }
+
+    /* out of fds, or the process is gone already */
+    untrackedProcs++;
+}
+
+void superviseChildren() {
+    struct epoll_event events[SUPERVISOR_EVENTS];
+    siginfo_t info;
+    int numEvents;
+    int i;
+
+    while ((numEvents = epoll_wait(supervisorFd, events, SUPERVISOR_EVENTS, 0)) > 0) {
+        for (i = 0; i < numEvents; i++) {
+            process *p = events[i].data.ptr;
+            struct rusage usage;
+
+            /* the SIGCHLD fd, or reaped elsewhere (fg) earlier in this batch */
+            if (p == NULL || p->pidfd < 0) {
+                continue;
+            }
+
+            /* the raw syscall also returns the rusage */
+            memset(&info, 0, sizeof(info));
+            if (syscall(SYS_waitid, P_PIDFD, p->pidfd, &info, WEXITED | WNOHANG, &usage) < 0 || info.si_pid == 0) {
+                continue;
+            }
+
+            if (info.si_code == CLD_EXITED) {
+                markProcess(p, COMPLETED, -1, info.si_status, &usage);
+            } else {
+                markProcess(p, TERMINATED, info.si_status, 0, &usage);
+            }
+        }
+
+        if (numEvents < SUPERVISOR_EVENTS) {
+            break;
+        }
+    }
+
+    /* pidfds only report exits, stops still come through SIGCHLD */
+    while (1) {
+        memset(&info, 0, sizeof(info));
+        if (waitid(P_ALL, 0, &info, WSTOPPED | WNOHANG) < 0 || info.si_pid == 0) {
+            break;
+        }
+        markJob(info.si_pid, STOPPED, -1, 0, NULL);
+    }
+}
+#endif
+
+#ifndef __linux__
+void sigchldHandler(int signum) {
+    int oldErrno = errno;
+
+    TRACE(TRACE_SIGCHLD, 0, 1);
+
+    /* the main loop does the reaping */
+    write(childEventPipe[1], "", 1);
+    errno = oldErrno;
+}
+#endif
+
+/* only records the interrupt, so that shell doesn't exit */
+void sigintHandler(int signum) {
+    interrupted = 1;
+}
+void sigtstpHandler(int signum) {
+}
+
+void initArena(arena *a, size_t capacity) {
+    a->base = malloc(capacity);
+    a->used = 0;
+    a->capacity = capacity;
+    a->overflow = NULL;
+    a->overflowSize = 0;
+}
+
+void *arenaAlloc(arena *a, size_t size) {
+    arenaChunk *chunk;
+    size_t chunkSize;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    if (a->used + size <= a->capacity) {
+        void *result = a->base + a->used;
+        a->used += size;
+        return result;
+    }
+
+    /* doesn't fit, the chunk's header is padded to keep the alignment */
+    chunkSize = size > a->capacity ? size : a->capacity;
+    chunk = malloc(ARENA_ALIGN + chunkSize);
+    chunk->next = a->overflow;
+    chunk->size = chunkSize;
+    a->overflow = chunk;
+    a->overflowSize += chunkSize;
+
+    return (char *) chunk + ARENA_ALIGN;
+}
+
+char *arenaCopy(arena *a, char *string, size_t length) {
+    char *result = arenaAlloc(a, length + 1);
+
+    memcpy(result, string, length);
+    result[length] = '\0';
+
+    return result;
+}
+
+void resetArena(arena *a) {
+    if (a->overflow != NULL) {
+        /* grow so everything the last line needed fits in one block */
+        while (a->overflow != NULL) {
+            arenaChunk *next = a->overflow->next;
+            free(a->overflow);
+            a->overflow = next;
+        }
+
+        a->capacity += a->overflowSize;
+        a->overflowSize = 0;
+        free(a->base);
+        a->base = malloc(a->capacity);
+    }
+
+    a->used = 0;
+}
+
+void initLineReader(lineReader *reader, int fd, char *prompt, size_t capacity) {
+    reader->fd = fd;
+    reader->prompt = prompt;
+    reader->capacity = capacity;
+    reader->buffer = malloc(reader->capacity);
+    reader->start = 0;
+    reader->length = 0;
+    reader->eof = 0;
+}
+
+void initMemoryReader(lineReader *reader, char *data, size_t length) {
+    reader->fd = -1;
+    reader->prompt = NULL;
+    reader->capacity = length;
+    reader->buffer = data;
+    reader->start = 0;
+    reader->length = length;
+    reader->eof = 1;
+}
+
+int initFileReader(lineReader *reader, char *path) {
+    struct stat sb;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+        char *data = "";
+
+        /* lines aren't modified, so a read-only mapping is enough */
+        if (sb.st_size > 0) {
+            data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+
+        if (data != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+            if (sb.st_size > 0) {
+                madvise(data, sb.st_size, MADV_SEQUENTIAL);
+            }
+#endif
+            close(fd);
+            initMemoryReader(reader, data, sb.st_size);
+            return 0;
+        }
+    }
+
+    /* pipes, devices, or mmap failed */
+    initLineReader(reader, fd, NULL, READ_BUFFER_SIZE);
+    return 0;
+}
+
+char *readLine(lineReader *reader, size_t *length) {
+    while (1) {
+        char *line = reader->buffer + reader->start;
+        char *newline = memchr(line, '\n', reader->length - reader->start);
+        ssize_t bytesRead;
+
+        if (newline != NULL) {
+            *length = newline - line;
+            reader->start = newline + 1 - reader->buffer;
+
+            /* buffered lines don't go through waitForInput, so pick up
+             * child events here to keep job states current */
+            handleChildEvents();
+            return line;
+        }
+
+        if (reader->eof) {
+            if (reader->start == reader->length) {
+                return NULL;
+            }
+
+            /* last line without a newline */
+            *length = reader->length - reader->start;
+            reader->start = reader->length;
+            handleChildEvents();
+            return line;
+        }
+
+        /* move the partial line to the front, growing if it fills the buffer */
+        memmove(reader->buffer, line, reader->length - reader->start);
+        reader->length -= reader->start;
+        reader->start = 0;
+
+        if (reader->length == reader->capacity) {
+            reader->capacity *= 2;
+            reader->buffer = realloc(reader->buffer, reader->capacity);
+        }
+
+        waitForInput(reader);
+
+        bytesRead = read(reader->fd, reader->buffer + reader->length, reader->capacity - reader->length);
+        if (bytesRead > 0) {
+            reader->length += bytesRead;
+        } else if (bytesRead == 0 || (errno != EINTR && errno != EAGAIN)) {
+            reader->eof = 1;
+        }
+    }
+}
+
+int atEndOfInput(lineReader *reader) {
+    size_t i;
+
+    if (!reader->eof) {
+        return 0;
+    }
+
+    for (i = reader->start; i < reader->length; i++) {
+        if (!isspace((unsigned char) reader->buffer[i])) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int handleChildEvents() {
+    if (!drainChildEvents()) {
+        return 0;
+    }
+
+    reapChildren();
+    return cleanUpJobs();
+}
+
+void waitForInput(lineReader *reader) {
+    struct pollfd fds[2];
+
+    fds[0].fd = reader->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = childEventFd;
+    fds[1].events = POLLIN;
+
+    fflush(stdout);
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        /* report jobs that finished while idle at the prompt */
+        if ((fds[1].revents & POLLIN) && handleChildEvents() > 0 && reader->prompt != NULL) {
+            printf("%s", reader->prompt);
+            fflush(stdout);
+        }
+
+        if (fds[0].revents) {
+            return;
+        }
+    }
+}
+
+int initEditor(lineEditor *e, char *prompt) {
+    if (tcgetattr(STDIN_FILENO, &e->cooked) < 0) {
+        return -1;
+    }
+
+    e->prompt = prompt;
+    e->capacity = TTY_BUFFER_SIZE;
+    e->buffer = malloc(e->capacity);
+    e->length = 0;
+    e->cursor = 0;
+    e->saved = NULL;
+    e->savedLength = 0;
+    e->historyPos = -1;
+    e->keyStart = 0;
+    e->keyLength = 0;
+
+    initHistory(&shellHistory);
+    return 0;
+}
+
+char *editLine(lineEditor *e, size_t *length) {
+    struct termios raw = e->cooked;
+    int done = 0;
+
+    /* keys come in one at a time and the editor does the echoing, signal
+     * keys included. Output processing stays on */
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    e->length = 0;
+    e->cursor = 0;
+    e->historyPos = -1;
+    refreshLine(e, e->prompt, e->buffer, 0, 0);
+
+    while (!done) {
+        int key = readKey(e);
+
+        if (key == 18) {
+            /* Ctrl-R, the key that ends the search is handled as usual */
+            key = searchMode(e);
+        }
+
+        switch (key) {
+        case -1:
+            /* end of input */
+            done = -1;
+            break;
+        case '\r':
+        case '\n':
+            done = 1;
+            break;
+        case 3:
+            /* Ctrl-C drops the line */
+            refreshLine(e, e->prompt, e->buffer, e->length, e->length);
+            printf("^C");
+            e->length = 0;
+            done = 2;
+            break;
+        case 4:
+            /* Ctrl-D, end of input at an empty line, else delete */
+            if (e->length == 0) {
+                done = -1;
+            } else if (e->cursor < e->length) {
+                memmove(e->buffer + e->cursor, e->buffer + e->cursor + 1, e->length - e->cursor - 1);
+                e->length--;
+            }
+            break;
+        case 127:
+        case 8:
+            if (e->cursor > 0) {
+                memmove(e->buffer + e->cursor - 1, e->buffer + e->cursor, e->length - e->cursor);
+                e->cursor--;
+                e->length--;
+            }
+            break;
+        case 1:
+            e->cursor = 0;
+            break;
+        case 5:
+            e->cursor = e->length;
+            break;
+        case 2:
+            if (e->cursor > 0) {
+                e->cursor--;
+            }
+            break;
+        case 6:
+            if (e->cursor < e->length) {
+                e->cursor++;
+            }
+            break;
+        case 11:
+            /* Ctrl-K, kill to the end */
+            e->length = e->cursor;
+            break;
+        case 21:
+            /* Ctrl-U, kill to the start */
+            memmove(e->buffer, e->buffer + e->cursor, e->length - e->cursor);
+            e->length -= e->cursor;
+            e->cursor = 0;
+            break;
+        case 23: {
+            /* Ctrl-W, kill the word before the cursor */
+            size_t start = e->cursor;
+
+            while (start > 0 && e->buffer[start - 1] == ' ') {
+                start--;
+            }
+            while (start > 0 && e->buffer[start - 1] != ' ') {
+                start--;
+            }
+            memmove(e->buffer + start, e->buffer + e->cursor, e->length - e->cursor);
+            e->length -= e->cursor - start;
+            e->cursor = start;
+            break;
+        }
+        case '\t':
+            completeWord(e);
+            break;
+        case 12:
+            /* Ctrl-L */
+            printf("\x1b[H\x1b[2J");
+            break;
+        case 16:
+            browseHistory(e, -1);
+            break;
+        case 14:
+            browseHistory(e, 1);
+            break;
+        case 27: {
+            /* escape sequences for the arrow, home, end and delete keys,
+             * a lone escape does nothing */
+            int first, second;
+
+            if (e->keyStart == e->keyLength) {
+                break;
+            }
+            first = readKey(e);
+            second = readKey(e);
+
+            if (first == '[' && second >= '0' && second <= '9') {
+                if (readKey(e) != '~') {
+                    break;
+                }
+                if ((second == '1' || second == '7')) {
+                    e->cursor = 0;
+                } else if (second == '4' || second == '8') {
+                    e->cursor = e->length;
+                } else if (second == '3' && e->cursor < e->length) {
+                    memmove(e->buffer + e->cursor, e->buffer + e->cursor + 1, e->length - e->cursor - 1);
+                    e->length--;
+                }
+            } else if (first == '[' || first == 'O') {
+                switch (second) {
+                case 'A':
+                    browseHistory(e, -1);
+                    break;
+                case 'B':
+                    browseHistory(e, 1);
+                    break;
+                case 'C':
+                    if (e->cursor < e->length) {
+                        e->cursor++;
+                    }
+                    break;
+                case 'D':
+                    if (e->cursor > 0) {
+                        e->cursor--;
+                    }
+                    break;
+                case 'H':
+                    e->cursor = 0;
+                    break;
+                case 'F':
+                    e->cursor = e->length;
+                    break;
+                }
+            }
+            break;
+        }
+        default:
+            if (key >= 32 && key != 127) {
+                insertKey(e, key);
+            }
+            break;
+        }
+
+        /* pasted input is drawn once it has all been handled */
+        if (!done && e->keyStart == e->keyLength) {
+            refreshLine(e, e->prompt, e->buffer, e->length, e->cursor);
+        }
+    }
+
+    if (done == 1) {
+        refreshLine(e, e->prompt, e->buffer, e->length, e->length);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &e->cooked);
+
+    if (done < 0) {
+        return NULL;
+    }
+
+    e->buffer[e->length] = '\0';
+    *length = e->length;
+    return e->buffer;
+}
+
+int readKey(lineEditor *e) {
+    struct pollfd fds[2];
+
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = childEventFd;
+    fds[1].events = POLLIN;
+
+    while (e->keyStart == e->keyLength) {
+        ssize_t bytesRead;
+
+        fflush(stdout);
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        /* report jobs that finished while editing, then draw the line again */
+        if ((fds[1].revents & POLLIN) && drainChildEvents()) {
+            reapChildren();
+            printf("\r\x1b[K");
+            cleanUpJobs();
+            refreshLine(e, e->shownPrompt, e->shownLine, e->shownLength, e->shownCursor);
+        }
+
+        if (fds[0].revents) {
+            bytesRead = read(STDIN_FILENO, e->keys, sizeof(e->keys));
+
+            if (bytesRead <= 0) {
+                if (bytesRead < 0 && (errno == EINTR || errno == EAGAIN)) {
+                    continue;
+                }
+                return -1;
+            }
+
+            e->keyStart = 0;
+            e->keyLength = bytesRead;
+        }
+    }
+
+    return (unsigned char) e->keys[e->keyStart++];
+}
+
+void refreshLine(lineEditor *e, char *prompt, char *line, size_t length, size_t cursor) {
+    struct winsize size;
+    size_t columns = 80;
+    size_t promptLength = strlen(prompt);
+
+    e->shownPrompt = prompt;
+    e->shownLine = line;
+    e->shownLength = length;
+    e->shownCursor = cursor;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) {
+        columns = size.ws_col;
+    }
+
+    /* one terminal row, scrolled sideways to keep the cursor in view */
+    while (cursor > 0 && promptLength + cursor >= columns) {
+        line++;
+        length--;
+        cursor--;
+    }
+    if (promptLength + length > columns) {
+        length = columns > promptLength ? columns - promptLength : 0;
+    }
+
+    printf("\r\x1b[K%s%.*s", prompt, (int) length, line);
+    if (cursor < length) {
+        printf("\r\x1b[%zuC", promptLength + cursor);
+    }
+    fflush(stdout);
+}
+
+void setLine(lineEditor *e, char *text, size_t length) {
+    if (length + 1 > e->capacity) {
+        e->capacity = length + 1;
+        e->buffer = realloc(e->buffer, e->capacity);
+    }
+
+    memmove(e->buffer, text, length);
+    e->length = length;
+    e->cursor = length;
+}
+
+void insertKey(lineEditor *e, char key) {
+    /* room for the null terminator stays */
+    if (e->length + 2 > e->capacity) {
+        e->capacity *= 2;
+        e->buffer = realloc(e->buffer, e->capacity);
+    }
+
+    memmove(e->buffer + e->cursor + 1, e->buffer + e->cursor, e->length - e->cursor);
+    e->buffer[e->cursor++] = key;
+    e->length++;
+}
+
+void browseHistory(lineEditor *e, int direction) {
+    history *h = &shellHistory;
+    long position;
+    char *end;
+
+    if (e->historyPos < 0) {
+        if (direction > 0) {
+            return;
+        }
+
+        /* starting out, other shells may have added entries */
+        refreshHistory(h);
+        if ((position = previousEntry(h, h->length)) < 0) {
+            return;
+        }
+
+        e->saved = realloc(e->saved, e->length + 1);
+        memcpy(e->saved, e->buffer, e->length);
+        e->savedLength = e->length;
+    } else if (direction < 0) {
+        if ((position = previousEntry(h, e->historyPos)) < 0) {
+            return;
+        }
+    } else {
+        end = memchr(h->data + e->historyPos, '\n', h->length - e->historyPos);
+        position = end + 1 - h->data;
+
+        if (position >= h->length) {
+            /* past the newest entry, back to the line being edited */
+            setLine(e, e->saved, e->savedLength);
+            e->historyPos = -1;
+            return;
+        }
+    }
+
+    e->historyPos = position;
+    end = memchr(h->data + position, '\n', h->length - position);
+    setLine(e, h->data + position, end - (h->data + position));
+}
+
+int searchMode(lineEditor *e) {
+    history *h = &shellHistory;
+    char query[256];
+    char prompt[sizeof(query) + 32];
+    size_t queryLength = 0;
+    size_t matchedLength = 0;   /* how much of the query the match has */
+    long match = -1;
+    int key;
+
+    refreshHistory(h);
+
+    while (1) {
+        char *entry = e->buffer;
+        size_t entryLength = e->length;
+        size_t cursor = e->cursor;
+
+        snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%.*s': ",
+                matchedLength < queryLength ? "failed " : "", (int) queryLength, query);
+
+        if (match >= 0) {
+            entry = h->data + match;
+            entryLength = (char *) memchr(entry, '\n', h->length - match) - entry;
+            cursor = (char *) memmem(entry, entryLength, query, matchedLength) - entry;
+        }
+        refreshLine(e, prompt, entry, entryLength, cursor);
+
+        key = readKey(e);
+
+        if (key == 18 || (key >= 32 && key < 127)) {
+            /* Ctrl-R looks further back, a longer query may still be in
+             * the current match */
+            long from = match >= 0 ? match : h->length;
+            long found;
+
+            if (key != 18 && queryLength < sizeof(query)) {
+                query[queryLength++] = key;
+                from = match >= 0 ? match + 1 : h->length;
+            }
+
+            if (queryLength > 0 && (found = searchHistory(h, query, queryLength, from)) >= 0) {
+                match = found;
+                matchedLength = queryLength;
+            }
+        } else if (key == 127 || key == 8) {
+            if (queryLength > 0) {
+                queryLength--;
+            }
+            match = queryLength > 0 ? searchHistory(h, query, queryLength, h->length) : -1;
+            matchedLength = match >= 0 ? queryLength : 0;
+        } else if (key == 7 || key == 3 || key < 0) {
+            /* Ctrl-G/Ctrl-C leave the line as it was */
+            return key == 3 ? 0 : key;
+        } else {
+            if (match >= 0) {
+                setLine(e, entry, entryLength);
+            }
+            return key;
+        }
+    }
+}
+
+void initHistory(history *h) {
+    char *path = getenv("HISTFILE");
+    char defaultPath[PATH_MAX];
+
+    memset(h, 0, sizeof(history));
+    h->fd = -1;
+
+    /* an empty $HISTFILE turns history off */
+    if (path == NULL) {
+        char *home = getenv("HOME");
+
+        if (home == NULL) {
+            return;
+        }
+        snprintf(defaultPath, sizeof(defaultPath), "%s/%s", home, HISTORY_FILE);
+        path = defaultPath;
+    }
+
+    if (path[0] == '\0') {
+        return;
+    }
+
+    if ((h->fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+        return;
+    }
+
+    /* only mapped, entries are found when they are needed */
+    refreshHistory(h);
+}
+
+void refreshHistory(history *h) {
+    struct stat sb;
+    char *end;
+
+    if (h->fd < 0 || fstat(h->fd, &sb) < 0 || sb.st_size == h->mapped) {
+        return;
+    }
+
+    if (h->data != NULL) {
+        munmap(h->data, h->mapped);
+    }
+
+    if (sb.st_size < h->mapped) {
+        /* truncated, start over */
+        h->numBlocks = 0;
+        h->indexed = 0;
+    }
+
+    h->data = NULL;
+    h->mapped = 0;
+    h->length = 0;
+
+    if (sb.st_size == 0) {
+        return;
+    }
+
+    if ((h->data = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, h->fd, 0)) == MAP_FAILED) {
+        h->data = NULL;
+        h->numBlocks = 0;
+        h->indexed = 0;
+        return;
+    }
+    h->mapped = sb.st_size;
+
+    /* an entry another shell is still appending is left for next time */
+    if ((end = memrchr(h->data, '\n', h->mapped)) != NULL) {
+        h->length = end + 1 - h->data;
+    }
+}
+
+void addHistory(history *h, char *line, size_t length) {
+    struct iovec parts[2];
+
+    if (h->fd < 0 || length == 0) {
+        return;
+    }
+
+    if (h->lastEntry != NULL && strlen(h->lastEntry) == length && memcmp(h->lastEntry, line, length) == 0) {
+        return;
+    }
+
+    free(h->lastEntry);
+    h->lastEntry = strndup(line, length);
+
+    /* one write with O_APPEND lands whole at the end of the file, the lock
+     * keeps shells on file systems where that isn't atomic in line too */
+    parts[0].iov_base = line;
+    parts[0].iov_len = length;
+    parts[1].iov_base = "\n";
+    parts[1].iov_len = 1;
+
+    flock(h->fd, LOCK_EX);
+    writev(h->fd, parts, 2);
+    flock(h->fd, LOCK_UN);
+}
+
+long previousEntry(history *h, size_t offset) {
+    char *newline;
+
+    if (offset == 0 || h->data == NULL) {
+        return -1;
+    }
+
+    /* data[offset - 1] ends the entry before offset */
+    newline = memrchr(h->data, '\n', offset - 1);
+    return newline != NULL ? newline + 1 - h->data : 0;
+}
+
+void indexHistory(history *h) {
+    while (h->indexed < h->length) {
+        char *line = h->data + h->indexed;
+        char *newline = memchr(line, '\n', h->length - h->indexed);
+        historyBlock *block;
+        size_t i;
+
+        if (h->numBlocks == 0 || h->blocks[h->numBlocks - 1].entries == HISTORY_BLOCK_ENTRIES) {
+            if (h->numBlocks == h->blockCapacity) {
+                h->blockCapacity = h->blockCapacity == 0 ? 64 : h->blockCapacity * 2;
+                h->blocks = realloc(h->blocks, h->blockCapacity * sizeof(historyBlock));
+            }
+
+            block = &h->blocks[h->numBlocks++];
+            block->start = h->indexed;
+            block->entries = 0;
+            memset(block->signature, 0, sizeof(block->signature));
+        }
+
+        block = &h->blocks[h->numBlocks - 1];
+        for (i = 0; i + 3 <= newline - line; i++) {
+            unsigned int bit = trigramBit(line + i);
+
+            block->signature[bit >> 3] |= 1 << (bit & 7);
+        }
+        block->entries++;
+
+        h->indexed = newline + 1 - h->data;
+    }
+}
+
+long searchHistory(history *h, char *query, size_t queryLength, size_t offset) {
+    unsigned int bits[256];
+    int numBits = 0;
+    int low = 0, high;
+    int i;
+
+    if (h->data == NULL) {
+        return -1;
+    }
+
+    indexHistory(h);
+
+    /* a block can only hold a match if it has every trigram of the query */
+    for (i = 0; i + 3 <= queryLength && numBits < 256; i++) {
+        bits[numBits++] = trigramBit(query + i);
+    }
+
+    /* the last block starting before offset */
+    high = h->numBlocks;
+    while (low < high) {
+        int middle = (low + high) / 2;
+
+        if (h->blocks[middle].start < offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    for (i = low - 1; i >= 0; i--) {
+        historyBlock *block = &h->blocks[i];
+        char *end = h->data + (i + 1 < h->numBlocks ? h->blocks[i + 1].start : h->indexed);
+        char *line = h->data + block->start;
+        long found = -1;
+        int j;
+
+        for (j = 0; j < numBits; j++) {
+            if (!(block->signature[bits[j] >> 3] & (1 << (bits[j] & 7)))) {
+                break;
+            }
+        }
+        if (j < numBits) {
+            continue;
+        }
+
+        /* the newest matching entry in the block */
+        while (line < end && line - h->data < offset) {
+            char *newline = memchr(line, '\n', end - line);
+
+            if (memmem(line, newline - line, query, queryLength) != NULL) {
+                found = line - h->data;
+            }
+            line = newline + 1;
+        }
+
+        if (found >= 0) {
+            return found;
+        }
+    }
+
+    return -1;
+}
+
+unsigned int trigramBit(char *trigram) {
+    unsigned int value = (unsigned char) trigram[0] << 16 | (unsigned char) trigram[1] << 8 | (unsigned char) trigram[2];
+
+    /* Fibonacci hashing, the top bits are the best mixed */
+    return (value * 2654435769u) >> 20 & (HISTORY_SIGNATURE_BITS - 1);
+}
+
+char **tokenize(arena *lineArena, char *input, int *numTokens, int *bgProcess) {
+    char **result;
+    int currentSize;
+
+    /* count tokens first so the array is allocated once */
+    currentSize = scanTokens(input, NULL);
+    result = arenaAlloc(lineArena, (currentSize + 1) * sizeof(char*));
+
+    *numTokens = scanTokens(input, result);
+    result[*numTokens] = NULL;
+
+    /* an & that a variable expands to is a word */
+    *bgProcess = handleAmpersand(result, numTokens);
+
+    *numTokens = expandVariables(lineArena, result, *numTokens);
+    return expandGlobs(lineArena, result, numTokens);
+}
+
+int scanTokens(char *input, char **tokens) {
+    char *current = input;
+    int currentSize = 0;
+
+    while (*current) {
+        char *operator;
+        size_t length;
+
+        current += strspn(current, " \t\r\n");
+
+        if ((operator = scanOperator(current, &length)) != NULL) {
+            /* operators are tokens even without surrounding whitespace */
+            if (tokens != NULL) {
+                tokens[currentSize] = operator;
+            }
+            currentSize++;
+            current += length;
+        } else if (*current) {
+            if (tokens != NULL) {
+                tokens[currentSize] = current;
+            }
+            currentSize++;
+            current += strcspn(current, " \t\r\n|<>");
+
+            if ((operator = scanOperator(current, &length)) != NULL) {
+                /* the terminator replaces the operator, so emit it now */
+                if (tokens != NULL) {
+                    *current = '\0';
+                    tokens[currentSize] = operator;
+                }
+                currentSize++;
+                current += length;
+            } else if (*current) {
+                if (tokens != NULL) {
+                    *current = '\0';
+                }
+                current++;
+            }
+        }
+    }
+
+    return currentSize;
+}
+
+char *scanOperator(char *input, size_t *length) {
+    int i;
+
+    if (*input == '|') {
+        *length = 1;
+        return pipeToken;
+    }
+
+    /* only 2>... starts with something other than < or > */
+    if (*input != '<' && *input != '>' && *input != '2') {
+        return NULL;
+    }
+
+    for (i = 0; i < NUM_REDIRECT_OPERATORS; i++) {
+        char *token = redirectOperators[i].token;
+        size_t tokenLength = strlen(token);
+
+        if (strncmp(input, token, tokenLength) == 0) {
+            *length = tokenLength;
+            return token;
+        }
+    }
+
+    return NULL;
+}
+
+redirectOperator *findRedirect(char *token) {
+    int i;
+
+    for (i = 0; i < NUM_REDIRECT_OPERATORS; i++) {
+        if (token == redirectOperators[i].token) {
+            return &redirectOperators[i];
+        }
+    }
+
+    return NULL;
+}
+
+int handleAmpersand(char **tokens, int *numTokens) {
+    int lastTokenLength;
+
+    if (*numTokens == 0) {
+        return 0;
+    }
+
+    /* last token is an ampersand */
+    if (strcmp(tokens[*numTokens - 1], "&") == 0) {
+        (*numTokens)--;
+        tokens[*numTokens] = NULL;
+        return 1;
+    }
+
+    lastTokenLength = strlen(tokens[*numTokens - 1]);
+
+    /* last character of last token is an ampersand */
+    if (tokens[*numTokens - 1][lastTokenLength - 1] == '&') {
+        tokens[*numTokens - 1][lastTokenLength - 1] = '\0';
+        return 1;
+    }
+
+    return 0;
+}
+
+char **expandGlobs(arena *lineArena, char **tokens, int *numTokens) {
+    globState g;
+    char **result;
+    int numResults = 0, capacity;
+    int i;
+
+    for (i = 0; i < *numTokens; i++) {
+        if (strpbrk(tokens[i], "*?[") != NULL) {
+            break;
+        }
+    }
+    if (i == *numTokens) {
+        return tokens;
+    }
+
+    g.a = lineArena;
+    g.listings = NULL;
+
+    capacity = *numTokens;
+    result = arenaAlloc(lineArena, (capacity + 1) * sizeof(char *));
+
+    for (i = 0; i < *numTokens; i++) {
+        char *token = tokens[i];
+        redirectOperator *previous = i > 0 ? findRedirect(tokens[i - 1]) : NULL;
+        int needed;
+
+        g.matches = NULL;
+        g.numMatches = 0;
+        g.capacity = 0;
+
+        if (strpbrk(token, "*?[") != NULL) {
+            if (*token == '/') {
+                globPath(&g, "/", 1, token + strspn(token, "/"));
+            } else {
+                globPath(&g, "", 0, token);
+            }
+        }
+
+        /* a pattern without matches stays as it is, and so does a
+         * redirection target unless it matches a single file */
+        if (g.numMatches == 0 || (g.numMatches > 1 && previous != NULL && previous->flags != -1)) {
+            g.matches = &tokens[i];
+            g.numMatches = 1;
+        } else if (g.numMatches > 1) {
+            /* directories are read in no particular order */
+            qsort(g.matches, g.numMatches, sizeof(char *), compareNames);
+        }
+
+        needed = numResults + g.numMatches + (*numTokens - i - 1);
+        if (needed > capacity) {
+            char **grown;
+
+            capacity = needed * 2;
+            grown = arenaAlloc(lineArena, (capacity + 1) * sizeof(char *));
+            memcpy(grown, result, numResults * sizeof(char *));
+            result = grown;
+        }
+
+        memcpy(result + numResults, g.matches, g.numMatches * sizeof(char *));
+        numResults += g.numMatches;
+    }
+
+    while (g.listings != NULL) {
+        globListing *next = g.listings->next;
+
+        free(g.listings->names);
+        free(g.listings);
+        g.listings = next;
+    }
+
+    result[numResults] = NULL;
+    *numTokens = numResults;
+    return result;
+}
+
+void globPath(globState *g, char *prefix, size_t prefixLength, char *pattern) {
+    char *slash = strchr(pattern, '/');
+    size_t length = slash != NULL ? (size_t) (slash - pattern) : strlen(pattern);
+    char *rest = slash != NULL ? slash + strspn(slash, "/") : NULL;
+    size_t literal = strcspn(pattern, "*?[");
+    char *suffix = NULL;
+    size_t suffixLength = 0;
+    globListing *listing;
+    char *path;
+    int i;
+
+    if (literal >= length) {
+        /* a component without wildcards is taken as it is, only checking
+         * that the whole path exists at the end */
+        path = arenaAlloc(g->a, prefixLength + length + 2);
+        memcpy(path, prefix, prefixLength);
+        memcpy(path + prefixLength, pattern, length);
+        path[prefixLength + length] = '\0';
+
+        if (rest == NULL || *rest == '\0') {
+            struct stat sb;
+
+            if (rest == NULL ? lstat(path, &sb) == 0 : stat(path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+                if (rest != NULL) {
+                    strcpy(path + prefixLength + length, "/");
+                }
+                addMatch(g, path);
+            }
+            return;
+        }
+
+        strcpy(path + prefixLength + length, "/");
+        globPath(g, path, prefixLength + length + 1, rest);
+        return;
+    }
+
+    if ((listing = globDirectory(g, prefix)) == NULL) {
+        return;
+    }
+
+    /* the literal text after the last * must end the name, which is cheap
+     * to check before matching (*.log) */
+    for (i = length; i > 0 && pattern[i - 1] != '*'; i--) {
+        continue;
+    }
+    if (i > 0 && strcspn(pattern + i, "?[") >= length - i) {
+        suffix = pattern + i;
+        suffixLength = length - i;
+    }
+
+    for (i = 0; i < listing->numNames; i++) {
+        char *name = listing->names[i];
+        size_t nameLength;
+        unsigned char type;
+
+        /* hidden files only match a pattern that starts with a dot */
+        if (name[0] == '.' && pattern[0] != '.') {
+            continue;
+        }
+
+        /* the literal prefix first, then the rest of the pattern */
+        if (strncmp(name, pattern, literal) != 0) {
+            continue;
+        }
+        if (suffix != NULL) {
+            nameLength = strlen(name);
+            if (nameLength < literal + suffixLength || memcmp(name + nameLength - suffixLength, suffix, suffixLength) != 0) {
+                continue;
+            }
+        }
+        if (!globMatch(pattern + literal, length - literal, name + literal)) {
+            continue;
+        }
+
+        if (rest == NULL) {
+            /* names in the working directory are their own paths */
+            if (prefixLength == 0) {
+                addMatch(g, name);
+            } else {
+                nameLength = strlen(name);
+                path = arenaAlloc(g->a, prefixLength + nameLength + 1);
+                memcpy(path, prefix, prefixLength);
+                memcpy(path + prefixLength, name, nameLength + 1);
+                addMatch(g, path);
+            }
+            continue;
+        }
+
+        /* more components follow, so only directories are of interest */
+        nameLength = strlen(name);
+        path = arenaAlloc(g->a, prefixLength + nameLength + 2);
+        memcpy(path, prefix, prefixLength);
+        memcpy(path + prefixLength, name, nameLength);
+        path[prefixLength + nameLength] = '\0';
+
+        type = name[-1];
+        if (type != DT_DIR) {
+            struct stat sb;
+
+            if ((type != DT_LNK && type != DT_UNKNOWN) || stat(path, &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+                continue;
+            }
+        }
+
+        strcpy(path + prefixLength + nameLength, "/");
+        if (*rest == '\0') {
+            addMatch(g, path);
+        } else {
+            globPath(g, path, prefixLength + nameLength + 1, rest);
+        }
+    }
+}
+
+globListing *globDirectory(globState *g, char *path) {
+    static char *buffer = NULL;
+    globListing *listing;
+    DIR *dir = NULL;
+    char *space = NULL;
+    size_t spaceLeft = 0;
+    int capacity = 256;
+    ssize_t bytesRead;
+    int fd;
+
+    for (listing = g->listings; listing != NULL; listing = listing->next) {
+        if (strcmp(listing->path, path) == 0) {
+            return listing;
+        }
+    }
+
+    if ((fd = open(*path != '\0' ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return NULL;
+    }
+#ifndef __linux__
+    if ((dir = fdopendir(fd)) == NULL) {
+        close(fd);
+        return NULL;
+    }
+#endif
+
+    if (buffer == NULL) {
+        buffer = malloc(GLOB_BUFFER_SIZE);
+    }
+
+    listing = malloc(sizeof(globListing));
+    listing->path = path;
+    listing->names = malloc(capacity * sizeof(char *));
+    listing->numNames = 0;
+
+    while ((bytesRead = readEntries(dir, fd, buffer, GLOB_BUFFER_SIZE)) > 0) {
+        ssize_t position;
+
+        for (position = 0; position < bytesRead; ) {
+            struct dirent64 *entry = (struct dirent64 *) (buffer + position);
+            char *name = entry->d_name;
+            size_t length = strlen(name);
+
+            position += entry->d_reclen;
+
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+
+            /* names are packed into big arena blocks, each after its type */
+            if (length + 2 > spaceLeft) {
+                spaceLeft = length + 2 > GLOB_BLOCK_SIZE ? length + 2 : GLOB_BLOCK_SIZE;
+                space = arenaAlloc(g->a, spaceLeft);
+            }
+            if (listing->numNames == capacity) {
+                capacity *= 2;
+                listing->names = realloc(listing->names, capacity * sizeof(char *));
+            }
+
+            space[0] = entry->d_type;
+            memcpy(space + 1, name, length + 1);
+            listing->names[listing->numNames++] = space + 1;
+            space += length + 2;
+            spaceLeft -= length + 2;
+        }
+    }
+
+    if (dir != NULL) {
+        closedir(dir);
+    } else {
+        close(fd);
+    }
+
+    listing->next = g->listings;
+    g->listings = listing;
+    return listing;
+}
+
+int globMatch(char *pattern, size_t length, char *name) {
+    char *end = pattern + length;
+    char *starPattern = NULL, *starName = NULL;
+
+    while (*name != '\0') {
+        char *next = pattern + 1;
+        int matched = 0;
+
+        if (pattern < end && *pattern == '*') {
+            /* try matching nothing first, then one more character each
+             * time the rest fails */
+            starPattern = ++pattern;
+            starName = name;
+            continue;
+        }
+
+        if (pattern < end) {
+            if (*pattern == '?') {
+                matched = 1;
+            } else if (*pattern != '[' || (matched = matchClass(pattern, end, *name, &next)) < 0) {
+                /* an unterminated [ is an ordinary character */
+                next = pattern + 1;
+                matched = *pattern == *name;
+            }
+        }
+
+        if (matched) {
+            pattern = next;
+            name++;
+        } else if (starPattern != NULL) {
+            pattern = starPattern;
+            name = ++starName;
+        } else {
+            return 0;
+        }
+    }
+
+    while (pattern < end && *pattern == '*') {
+        pattern++;
+    }
+    return pattern == end;
+}
+
+int matchClass(char *pattern, char *end, char c, char **next) {
+    char *current = pattern + 1;
+    int negate = 0, matched = 0;
+
+    if (current < end && (*current == '!' || *current == '^')) {
+        negate = 1;
+        current++;
+    }
+
+    /* a ] right after the [ is one of the characters */
+    do {
+        if (current >= end) {
+            return -1;
+        }
+
+        if (current + 2 < end && current[1] == '-' && current[2] != ']') {
+            if ((unsigned char) c >= (unsigned char) current[0] && (unsigned char) c <= (unsigned char) current[2]) {
+                matched = 1;
+            }
+            current += 3;
+        } else {
+            if (*current == c) {
+                matched = 1;
+            }
+            current++;
+        }
+    } while (current >= end || *current != ']');
+
+    *next = current + 1;
+    return matched != negate;
+}
+
+void addMatch(globState *g, char *path) {
+    if (g->numMatches == g->capacity) {
+        char **grown;
+
+        g->capacity = g->capacity > 0 ? g->capacity * 2 : 64;
+        grown = arenaAlloc(g->a, g->capacity * sizeof(char *));
+        if (g->numMatches > 0) {
+            memcpy(grown, g->matches, g->numMatches * sizeof(char *));
+        }
+        g->matches = grown;
+    }
+
+    g->matches[g->numMatches++] = path;
+}
+
+int bg(char **argv, int numTokens) {
+    targetSet targets;
+    int status = 0;
+    int i;
+
+    if (numTokens < 2) {
+        puts("bg: wrong number of arguments");
+        return 1;
+    }
+
+    if (parseTargets("bg", argv + 1, numTokens - 1, TARGETS_STATES, &targets) < 0) {
+        return 1;
+    }
+
+    for (i = 0; i < targets.numJobs; i++) {
+        job *current = targets.jobs[i];
+
+        if (current->state == RUNNING) {
+            /* only an error when it was named on its own */
+            if (targets.numJobs == 1) {
+                puts("bg: job is already running");
+                status = 1;
+            }
+            continue;
+        }
+
+        current->bgProcess = 1;
+        current->state = RUNNING;
+
+        if (kill(-current->pgid, SIGCONT) < 0) {
+            printf("bg: could not continue job %d\n", current->id);
+            status = 1;
+        }
+    }
+
+    return status;
+}
+
+int cd(char **argv, int numTokens) {
+    char *directory;
+    char cwd[PATH_MAX];
+
+    if (numTokens > 2) {
+        puts("cd: too many arguments");
+        return 1;
+    }
+
+    directory = numTokens == 1 ? variableValue("HOME") : argv[1];
+
+    if (directory != NULL) {
+        if (chdir(directory) != 0) {
+            printf("cd: no such file or directory: %s\n", directory);
+            return 1;
+        }
+        /* the resolved directory, not the argument: "cd .." must not append */
+        if (getcwd(cwd, sizeof(cwd)) != NULL) {
+            setVariable("PWD", 3, cwd, 1);
+            environGeneration++;
+        }
+
+        /* commands found through relative $PATH entries no longer resolve */
+        if (relativePathDirs) {
+            clearCommandHash();
+        }
+    }
+
+    return 0;
+}
+
+int exitFunc(char **argv, int numTokens) {
+    char *end;
+
+    if (numTokens > 2) {
+        puts("exit: too many arguments");
+        return 1;
+    }
+
+    if (numTokens == 2) {
+        long status = strtol(argv[1], &end, 10);
+
+        if (argv[1][0] == '\0' || *end != '\0') {
+            puts("exit: numeric argument required");
+            return 2;
+        }
+        lastStatus = status & 0xff;
+    }
+
+    cleanUpShell();
+    return 0;
+}
+
+int fg(char **argv, int numTokens) {
+    targetSet targets;
+    int status = 0;
+    int i;
+
+    if (numTokens < 2) {
+        puts("fg: wrong number of arguments");
+        return 1;
+    }
+
+    if (parseTargets("fg", argv + 1, numTokens - 1, TARGETS_STATES, &targets) < 0) {
+        return 1;
+    }
+
+    /* one after the other, until one of them is stopped */
+    for (i = 0; i < targets.numJobs; i++) {
+        job *current = targets.jobs[i];
+
+        if (current->liveProcs == 0) {
+            /* finished while an earlier one had the terminal */
+            status = jobStatus(current);
+            continue;
+        }
+
+        current->bgProcess = 0;
+        fflush(stdout);
+
+        if (current->state == STOPPED) {
+            if (kill(-current->pgid, SIGCONT) < 0) {
+                puts("fg: could not continue process");
+                return 1;
+            }
+            current->state = RUNNING;
+        }
+
+        waitForJob(current);
+        status = jobStatus(current);
+
+        if (current->state == STOPPED) {
+            break;
+        }
+    }
+
+    return status;
+}
+
+
+int jobs(char **argv, int numTokens) {
+    int flags = 0;
+    int i;
+
+    /* -l, -r, -s, -p and -v, separately or combined (-lr) */
+    for (i = 1; i < numTokens; i++) {
+        char *option = argv[i];
+
+        if (option[0] != '-' || option[1] == '\0') {
+            printf("jobs: invalid option: %s\n", argv[i]);
+            return 1;
+        }
+
+        while (*++option) {
+            switch (*option) {
+            case 'l':
+                flags |= JOBS_DETAILS;
+                break;
+            case 'r':
+                flags |= JOBS_RUNNING;
+                break;
+            case 's':
+                flags |= JOBS_STOPPED;
+                break;
+            case 'p':
+                flags |= JOBS_PIDS;
+                break;
+            case 'v':
+                flags |= JOBS_CGROUP;
+                break;
+            default:
+                printf("jobs: invalid option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+    }
+
+    printJobs(flags);
+
+    return 0;
+}
+
+int killFunc(char **argv, int numTokens) {
+    targetSet targets;
+    int signum = SIGTERM;
+    int wholeCgroup = 0;
+    int status = 0;
+    int i;
+
+    argv++;
+    numTokens--;
+
+    /* [-SIG | -s SIG | --cgroup] before the targets */
+    while (numTokens > 0 && argv[0][0] == '-' && argv[0][1] != '-' && argv[0][1] != '\0') {
+        char *name = argv[0] + 1;
+
+        if (strcmp(argv[0], "-s") == 0) {
+            if (numTokens < 2) {
+                puts("kill: -s: option requires an argument");
+                return 2;
+            }
+            name = argv[1];
+            argv++;
+            numTokens--;
+        }
+
+        if ((signum = parseSignal(name)) < 0) {
+            printf("kill: invalid signal: %s\n", name);
+            return 2;
+        }
+        argv++;
+        numTokens--;
+    }
+
+    /* --cgroup kills everything in the job's cgroup, including processes
+     * that left its process group */
+    if (numTokens > 0 && strcmp(argv[0], "--cgroup") == 0) {
+        wholeCgroup = 1;
+        argv++;
+        numTokens--;
+    }
+
+    if (numTokens == 0) {
+        puts("kill: wrong number of arguments");
+        return 1;
+    }
+
+    if (parseTargets("kill", argv, numTokens, TARGETS_STATES | (wholeCgroup ? 0 : TARGETS_PIDS), &targets) < 0) {
+        return 1;
+    }
+
+    /* everything was resolved before anything is sent */
+    for (i = 0; i < targets.numJobs; i++) {
+        job *current = targets.jobs[i];
+
+        if (wholeCgroup) {
+            char file[PATH_MAX];
+
+            if (current->cgroup == NULL) {
+                printf("kill: job %d has no cgroup\n", current->id);
+                status = 1;
+                continue;
+            }
+
+            snprintf(file, sizeof(file), "%s/cgroup.kill", current->cgroup);
+            if (writeCgroup(cgroupRootFd, file, "1") < 0) {
+                printf("kill: %s: %s\n", file, strerror(errno));
+                status = 1;
+            }
+            continue;
+        }
+
+        if (kill(-current->pgid, signum) < 0) {
+            printf("kill: job %d: %s\n", current->id, strerror(errno));
+            status = 1;
+            continue;
+        }
+
+        /* a stopped job only acts on the signal once it runs again, like in sh */
+        if (current->state == STOPPED && signum != SIGCONT && signum != SIGSTOP && signum != 0) {
+            kill(-current->pgid, SIGCONT);
+            current->state = RUNNING;
+        } else if (current->state == STOPPED && signum == SIGCONT) {
+            current->state = RUNNING;
+        }
+    }
+
+    for (i = 0; i < targets.numPids; i++) {
+        if (kill(targets.pids[i], signum) < 0) {
+            printf("kill: %d: %s\n", targets.pids[i], strerror(errno));
+            status = 1;
+        }
+    }
+
+    return status;
+}
+
+int limitFunc(char **argv, int numTokens) {
+    char file[PATH_MAX];
+    char value[64];
+    job *current;
+    int jid;
+    int status = 0;
+    int i;
+
+    if (numTokens < 2) {
+        puts("limit: usage: limit %job [cpu=PERCENT|max] [memory=SIZE[KMG]|max]");
+        return 2;
+    }
+
+    if ((jid = stringToJobId(argv[1])) == -1) {
+        puts("limit: invalid job id");
+        return 1;
+    }
+
+    if ((current = findJob(jid)) == NULL) {
+        puts("limit: job not found");
+        return 1;
+    }
+
+    if (current->cgroup == NULL) {
+        puts("limit: job has no cgroup (see $SHELL_CGROUP)");
+        return 1;
+    }
+
+    /* no settings shows the current ones */
+    if (numTokens == 2) {
+        char *files[] = { "cpu.max", "memory.max" };
+
+        for (i = 0; i < 2; i++) {
+            snprintf(file, sizeof(file), "%s/%s", current->cgroup, files[i]);
+            if (readCgroup(cgroupRootFd, file, value, sizeof(value)) == 0) {
+                printf("%s %s", files[i], value);
+            } else {
+                printf("%s: %s\n", files[i], strerror(errno));
+            }
+        }
+        return 0;
+    }
+
+    for (i = 2; i < numTokens; i++) {
+        char *setting = argv[i];
+        char *end;
+
+        if (strncmp(setting, "cpu=", 4) == 0) {
+            /* a percentage of one cpu per period, more than 100 for several */
+            setting += 4;
+            if (strcmp(setting, "max") == 0) {
+                snprintf(value, sizeof(value), "max %d", CGROUP_CPU_PERIOD);
+            } else {
+                double percent = strtod(setting, &end);
+
+                if (end == setting || (*end != '\0' && strcmp(end, "%") != 0) || percent <= 0) {
+                    printf("limit: invalid cpu limit: %s\n", setting);
+                    status = 1;
+                    continue;
+                }
+                snprintf(value, sizeof(value), "%ld %d", (long) (percent * CGROUP_CPU_PERIOD / 100), CGROUP_CPU_PERIOD);
+            }
+            snprintf(file, sizeof(file), "%s/cpu.max", current->cgroup);
+        } else if (strncmp(setting, "memory=", 7) == 0) {
+            setting += 7;
+            if (strcmp(setting, "max") == 0) {
+                strcpy(value, "max");
+            } else {
+                long long bytes = strtoll(setting, &end, 10);
+                int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+
+                if (end == setting || bytes <= 0 || (shift > 0 ? end[1] != '\0' : *end != '\0')) {
+                    printf("limit: invalid memory limit: %s\n", setting);
+                    status = 1;
+                    continue;
+                }
+                snprintf(value, sizeof(value), "%lld", bytes << shift);
+            }
+            snprintf(file, sizeof(file), "%s/memory.max", current->cgroup);
+        } else {
+            printf("limit: invalid setting: %s\n", setting);
+            status = 1;
+            continue;
+        }
+
+        if (writeCgroup(cgroupRootFd, file, value) < 0) {
+            /* ENOENT when the controller isn't enabled for the leaves */
+            printf("limit: %s: %s\n", file, strerror(errno));
+            status = 1;
+        }
+    }
+
+    return status;
+}
+
+int parallel(char **argv, int numTokens) {
+    long maxJobs = sysconf(_SC_NPROCESSORS_ONLN);
+    char **prefix;
+    int prefixArgc;
+    char **inputs = NULL;
+    char *lines = NULL;          /* inputs read from stdin */
+    char *cursor;
+    int numInputs;
+    int next = 0, inFlight = 0, finished = 0, failed = 0;
+    job **running;
+    job *done;
+    arena taskArena;
+    struct rusage usage;
+    struct timespec start, end;
+    struct timeval cpu;
+    double wall;
+    int nullFd;
+    int i;
+
+    argv++;
+    numTokens--;
+
+    /* -j K or -jK */
+    if (numTokens > 0 && strncmp(argv[0], "-j", 2) == 0) {
+        int attached = argv[0][2] != '\0';
+        char *value = attached ? argv[0] + 2 : argv[1];
+        char *end;
+
+        if (value == NULL || (maxJobs = strtol(value, &end, 10)) < 1 || *end != '\0') {
+            puts("parallel: -j: positive number of jobs required");
+            return 2;
+        }
+        argv += attached ? 1 : 2;
+        numTokens -= attached ? 1 : 2;
+    }
+
+    if (maxJobs < 1) {
+        maxJobs = 1;
+    }
+
+    /* command [args...] [::: inputs...], inputs are stdin lines without ::: */
+    prefix = argv;
+    for (prefixArgc = 0; prefixArgc < numTokens; prefixArgc++) {
+        if (strcmp(argv[prefixArgc], ":::") == 0) {
+            inputs = &argv[prefixArgc + 1];
+            break;
+        }
+    }
+
+    interrupted = 0;
+
+    if (inputs != NULL) {
+        numInputs = numTokens - prefixArgc - 1;
+    } else {
+        numInputs = readInputLines(&lines);
+    }
+
+    /* each task is a job, so they share the table with everything else */
+    if (maxJobs > JOBS_CAPACITY - activeJobs) {
+        maxJobs = JOBS_CAPACITY - activeJobs;
+    }
+    if (maxJobs == 0) {
+        puts("job table full");
+        free(lines);
+        return 1;
+    }
+
+    if ((nullFd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+        printf("parallel: /dev/null: %s\n", strerror(errno));
+        free(lines);
+        return 1;
+    }
+
+    running = calloc(maxJobs, sizeof(job *));
+    initArena(&taskArena, ARENA_MIN_SIZE);
+    memset(&usage, 0, sizeof(usage));
+    cursor = lines;
+
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (next < numInputs || inFlight > 0) {
+        struct pollfd fds;
+
+        /* fill every free slot */
+        for (i = 0; i < maxJobs && next < numInputs && !interrupted; i++) {
+            char *input;
+            int status;
+
+            if (running[i] != NULL) {
+                continue;
+            }
+
+            if (inputs != NULL) {
+                input = inputs[next];
+            } else {
+                input = cursor;
+                cursor += strlen(cursor) + 1;
+            }
+            next++;
+
+            status = launchTask(&taskArena, prefix, prefixArgc, input, nullFd, &running[i]);
+            resetArena(&taskArena);
+
+            if (status == 0) {
+                running[i]->slot = i;
+                inFlight++;
+            } else if (status > 0) {
+                finished++;
+                failed++;
+            }
+        }
+
+        if (inFlight == 0) {
+            if (interrupted) {
+                break;
+            }
+            continue;
+        }
+
+        /* the tasks don't have the terminal, so pass Ctrl-C on to them */
+        if (interrupted == 1) {
+            for (i = 0; i < maxJobs; i++) {
+                if (running[i] != NULL) {
+                    kill(-running[i]->pgid, SIGINT);
+                }
+            }
+            interrupted = 2;
+        }
+
+        fds.fd = childEventFd;
+        fds.events = POLLIN;
+        if (poll(&fds, 1, -1) < 0 && errno != EINTR) {
+            break;
+        }
+
+        if (!drainChildEvents()) {
+            continue;
+        }
+        reapChildren();
+
+        /* slots of finished tasks open up right away, other jobs that
+         * finished go back in the queue for cleanUpJobs() */
+        done = doneHead;
+        doneHead = doneTail = NULL;
+
+        while (done != NULL) {
+            job *current = done;
+
+            done = current->doneNext;
+
+            if (current->slot < 0 || running[current->slot] != current) {
+                queueDoneJob(current);
+                continue;
+            }
+
+            if (jobStatus(current) != 0) {
+                failed++;
+            }
+            addUsage(&usage, &current->usage);
+            finished++;
+            inFlight--;
+
+            running[current->slot] = NULL;
+            removeJob(current);
+            freeJob(current);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    wall = elapsedSeconds(&start, &end);
+
+    timeradd(&usage.ru_utime, &usage.ru_stime, &cpu);
+    printf("parallel: %d tasks, %d failed, %.3fs wall, %.1f tasks/s, cpu %.3fs, maxrss %ldKB\n",
+            finished, failed, wall, wall > 0 ? finished / wall : 0,
+            cpu.tv_sec + cpu.tv_usec / 1e6, usage.ru_maxrss);
+
+    close(nullFd);
+    free(taskArena.base);
+    free(running);
+    free(lines);
+
+    if (interrupted) {
+        return 128 + SIGINT;
+    }
+    return failed > 0 ? 1 : 0;
+}
+
+int launchTask(arena *a, char **prefix, int prefixArgc, char *input, int inFd, job **task) {
+    char **tokens;
+    int numTokens;
+    stage *stages;
+    int numStages;
+    int bgProcess;  /* tasks run in the background either way */
+
+    if (prefixArgc == 0) {
+        tokens = tokenize(a, arenaCopy(a, input, strlen(input)), &numTokens, &bgProcess);
+    } else {
+        numTokens = prefixArgc + 1;
+        tokens = arenaAlloc(a, (numTokens + 1) * sizeof(char*));
+        memcpy(tokens, prefix, prefixArgc * sizeof(char*));
+        tokens[prefixArgc] = input;
+        tokens[numTokens] = NULL;
+    }
+
+    if (numTokens == 0) {
+        return -1;
+    }
+
+    /* a task is a job of its own, which a builtin can't be */
+    if (prefixArgc == 0 && findBuiltin(tokens[0]) != NULL) {
+        printf("%s: shell builtin, can't run as a job\n", tokens[0]);
+        return 2;
+    }
+
+    if ((numStages = splitPipeline(a, tokens, numTokens, &stages)) < 0) {
+        return 2;
+    }
+
+    if (resolveStages(stages, numStages) != 0) {
+        return 127;
+    }
+
+    if (openRedirections(stages, numStages) < 0) {
+        return 1;
+    }
+
+    /* tasks run without the terminal, so they can't read from it */
+    stages[0].inFd = inFd;
+
+    if ((*task = launchJob(stages, numStages, numTokens, tokens, 0, 0)) == NULL) {
+        return errno == ENOENT ? 127 : 126;
+    }
+
+    return 0;
+}
+
+int readInputLines(char **data) {
+    lineReader stdinReader;
+    lineReader *reader = shellInput;
+    size_t used = 0, capacity = READ_BUFFER_SIZE;
+    int count = 0;
+    char *line;
+    size_t length;
+
+    /* share the shell's buffer if it reads stdin too, so nothing is lost */
+    if (reader == NULL || reader->fd != STDIN_FILENO || stdinRedirected) {
+        initLineReader(&stdinReader, STDIN_FILENO, NULL, READ_BUFFER_SIZE);
+        reader = &stdinReader;
+    }
+
+    *data = malloc(capacity);
+
+    while ((line = readLine(reader, &length)) != NULL) {
+        while (used + length + 1 > capacity) {
+            capacity *= 2;
+            *data = realloc(*data, capacity);
+        }
+
+        memcpy(*data + used, line, length);
+        (*data)[used + length] = '\0';
+        used += length + 1;
+        count++;
+    }
+
+    if (reader == &stdinReader) {
+        free(stdinReader.buffer);
+    }
+
+    return count;
+}
+
+#ifdef SERVE_MODE
+void serve(char *path) {
+    struct sockaddr_un address;
+    struct pollfd *fds = NULL;
+    int listenFd, probeFd;
+    int i;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        printf("shell: --serve: %s: path too long\n", path);
+        exit(2);
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    /* a socket nothing listens on any more was left by a server that's
+     * gone, and is replaced. One that's still served isn't */
+    if ((probeFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) >= 0) {
+        if (connect(probeFd, (struct sockaddr *) &address, sizeof(address)) < 0 && errno == ECONNREFUSED) {
+            unlink(path);
+        }
+        close(probeFd);
+    }
+
+    if ((listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0
+            || bind(listenFd, (struct sockaddr *) &address, sizeof(address)) < 0
+            || listen(listenFd, SOMAXCONN) < 0) {
+        printf("shell: --serve: %s: %s\n", path, strerror(errno));
+        exit(2);
+    }
+
+    for (i = 0; i < 3; i++) {
+        serveStdio[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+    }
+    serveNullFd = open("/dev/null", O_RDWR | O_CLOEXEC);
+
+    /* either ends the server, hanging up the jobs still running */
+    safeSignal(SIGTERM, sigintHandler);
+    interrupted = 0;
+
+    while (!interrupted) {
+        int numFds = 0;
+
+        fflush(stdout);
+
+        /* clients that hung up are polled as -1 (so ignored) until their
+         * jobs finish and the slot can go to a new client */
+        fds = realloc(fds, (2 + numServeClients) * sizeof(struct pollfd));
+        fds[numFds++] = (struct pollfd) { childEventFd, POLLIN, 0 };
+        fds[numFds++] = (struct pollfd) { listenFd, POLLIN, 0 };
+        for (i = 0; i < numServeClients; i++) {
+            fds[numFds++] = (struct pollfd) { serveClients[i].fd, POLLIN, 0 };
+        }
+
+        if (poll(fds, numFds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("shell: --serve: %s\n", strerror(errno));
+            break;
+        }
+
+        if ((fds[0].revents & POLLIN) && drainChildEvents()) {
+            reapChildren();
+            finishServedJobs();
+        }
+
+        for (i = 0; i < numServeClients; i++) {
+            if (fds[2 + i].revents != 0) {
+                serveRequest(i, fds[2 + i].revents & (POLLHUP | POLLERR));
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+
+            if (fd < 0) {
+                continue;
+            }
+
+            for (i = 0; i < numServeClients; i++) {
+                if (serveClients[i].fd < 0 && serveClients[i].running == 0) {
+                    break;
+                }
+            }
+            if (i == numServeClients) {
+                serveClients = realloc(serveClients, ++numServeClients * sizeof(serveClient));
+            }
+            serveClients[i] = (serveClient) { fd, 0, 0 };
+        }
+    }
+
+    close(listenFd);
+    unlink(path);
+
+    for (i = 0; i < numServeClients; i++) {
+        if (serveClients[i].fd >= 0) {
+            close(serveClients[i].fd);
+        }
+    }
+    free(serveClients);
+    free(fds);
+
+    cleanUpShell();
+}
+
+void serveRequest(int client, int hungUp) {
+    static char message[SERVE_MAX_REQUEST + 1];
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    serveClient *c = &serveClients[client];
+    struct msghdr header;
+    struct cmsghdr *rights;
+    struct iovec part;
+    int passed[3] = { -1, -1, -1 };
+    int numPassed = 0;
+    ssize_t length;
+    job *j = NULL;
+    char *error = NULL;
+    int status;
+    int id;
+    int i;
+
+    part.iov_base = message;
+    part.iov_len = SERVE_MAX_REQUEST;
+
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &part;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buffer;
+    header.msg_controllen = sizeof(control.buffer);
+
+    while ((length = recvmsg(c->fd, &header, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+        continue;
+    }
+
+    if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+
+    /* stdin, stdout and stderr in that order, any more are closed */
+    if (length >= 0) {
+        for (rights = CMSG_FIRSTHDR(&header); rights != NULL; rights = CMSG_NXTHDR(&header, rights)) {
+            size_t count;
+
+            if (rights->cmsg_level != SOL_SOCKET || rights->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+
+            for (count = (rights->cmsg_len - CMSG_LEN(0)) / sizeof(int), i = 0; i < (int) count; i++) {
+                int fd;
+
+                memcpy(&fd, CMSG_DATA(rights) + i * sizeof(int), sizeof(int));
+                if (numPassed < 3) {
+                    passed[numPassed++] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+
+    if (length < 0 || (length == 0 && hungUp)) {
+        /* the client hung up, so its jobs are hung up on, like a terminal's
+         * when it goes away */
+        job *current;
+
+        for (i = 0; i < numPassed; i++) {
+            close(passed[i]);
+        }
+        close(c->fd);
+        c->fd = -1;
+
+        for (current = jobListHead; current != NULL; current = current->next) {
+            if (current->slot == client && current->state != COMPLETED && current->state != TERMINATED) {
+                kill(-current->pgid, SIGHUP);
+                if (current->state == STOPPED) {
+                    kill(-current->pgid, SIGCONT);
+                }
+            }
+        }
+        return;
+    }
+
+    id = ++c->lastId;
+
+    if (header.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        error = "request too long";
+        status = 2;
+    } else if (activeJobs == JOBS_CAPACITY) {
+        error = "job table full";
+        status = 1;
+    } else {
+        /* the request's fds stand in for the server's own while it is
+         * launched, so every way of launching hands them to the job (and
+         * error messages go to its stdout) */
+        message[length] = '\0';
+        fflush(stdout);
+
+        dup2(passed[0] >= 0 ? passed[0] : serveNullFd, STDIN_FILENO);
+        for (i = 1; i < 3; i++) {
+            if (passed[i] >= 0) {
+                dup2(passed[i], i);
+            }
+        }
+
+        status = launchTask(&lineArena, NULL, 0, message, -1, &j);
+
+        fflush(stdout);
+        for (i = 0; i < 3; i++) {
+            if (i == STDIN_FILENO || passed[i] >= 0) {
+                if (serveStdio[i] >= 0) {
+                    dup2(serveStdio[i], i);
+                } else {
+                    close(i);
+                }
+            }
+        }
+
+        resetArena(&lineArena);
+        freeRetiredEntries();
+    }
+
+    for (i = 0; i < numPassed; i++) {
+        close(passed[i]);
+    }
+
+    if (error != NULL) {
+        sendReply(c, "{\"id\":%d,\"event\":\"exit\",\"status\":%d,\"error\":\"%s\"}", id, status, error);
+    } else if (status == 0) {
+        j->slot = client;
+        servedIds[j->id] = id;
+        c->running++;
+        sendReply(c, "{\"id\":%d,\"event\":\"start\",\"pgid\":%d}", id, (int) j->pgid);
+    } else {
+        /* nothing to run (an empty command line succeeds) */
+        sendReply(c, "{\"id\":%d,\"event\":\"exit\",\"status\":%d}", id, status < 0 ? 0 : status);
+    }
+}
+
+void finishServedJobs() {
+    job *done = doneHead;
+
+    doneHead = doneTail = NULL;
+
+    while (done != NULL) {
+        job *current = done;
+        serveClient *c;
+
+        done = current->doneNext;
+
+        if (current->slot < 0) {
+            queueDoneJob(current);
+            continue;
+        }
+
+        c = &serveClients[current->slot];
+        c->running--;
+
+        sendReply(c, "{\"id\":%d,\"event\":\"exit\",\"pgid\":%d,\"status\":%d,\"wall_s\":%.6f,"
+                "\"user_s\":%.6f,\"sys_s\":%.6f,\"maxrss_kb\":%ld}",
+                servedIds[current->id], (int) current->pgid, jobStatus(current),
+                elapsedSeconds(&current->startTime, &current->endTime),
+                current->usage.ru_utime.tv_sec + current->usage.ru_utime.tv_usec / 1e6,
+                current->usage.ru_stime.tv_sec + current->usage.ru_stime.tv_usec / 1e6,
+                current->usage.ru_maxrss);
+
+        finishedStatus[current->id] = jobStatus(current);
+        TRACE(TRACE_CLEANUP, current->pgid, finishedStatus[current->id]);
+        removeJob(current);
+        freeJob(current);
+    }
+}
+
+void sendReply(serveClient *c, const char *format, ...) {
+    char reply[SERVE_MAX_REPLY];
+    va_list arguments;
+    int length;
+
+    if (c->fd < 0) {
+        return;
+    }
+
+    va_start(arguments, format);
+    length = vsnprintf(reply, sizeof(reply), format, arguments);
+    va_end(arguments);
+
+    if (length >= (int) sizeof(reply)) {
+        length = sizeof(reply) - 1;
+    }
+
+    /* never blocks, so a client that doesn't read its replies can't hold
+     * up the others */
+    while (send(c->fd, reply, length, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno == EINTR) {
+        continue;
+    }
+}
+#endif
+
+int traceFunc(char **argv, int numTokens) {
+    int chrome = 0;
+    char *path = "-";
+    int i;
+
+    if (numTokens == 1) {
+        unsigned long start = traceHead - traceStart > TRACE_CAPACITY ? traceHead - TRACE_CAPACITY : traceStart;
+
+        printf("trace: %s, %lu events\n", tracing ? "on" : "off", traceHead - start);
+        return 0;
+    }
+
+    if (strcmp(argv[1], "on") == 0 && numTokens == 2) {
+        return startTrace() < 0 ? 1 : 0;
+    }
+
+    if (strcmp(argv[1], "off") == 0 && numTokens == 2) {
+        tracing = 0;
+        return 0;
+    }
+
+    if (strcmp(argv[1], "clear") == 0 && numTokens == 2) {
+        traceStart = traceHead;
+        return 0;
+    }
+
+    if (strcmp(argv[1], "dump") != 0) {
+        puts("usage: trace [on | off | clear | dump [--chrome] [file]]");
+        return 2;
+    }
+
+    /* trace dump [--chrome] [file], *.json files get Chrome's format */
+    for (i = 2; i < numTokens; i++) {
+        if (strcmp(argv[i], "--chrome") == 0) {
+            chrome = 1;
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            printf("trace: invalid option: %s\n", argv[i]);
+            return 2;
+        } else {
+            path = argv[i];
+            chrome |= chromeTracePath(path);
+        }
+    }
+
+    return dumpTrace(path, chrome) < 0 ? 1 : 0;
+}
+
+int waitFunc(char **argv, int numTokens) {
+    int any = 0;
+    int remaining = 0;
+    int found = 0;
+    int status = 0;
+    int numTargets = 0;
+    int givenStatus = 0;  /* of the last job given if it was cleaned up, else -1 */
+    job **targets;
+    job *seen = doneTail;
+    job *current;
+    int i;
+
+    argv++;
+    numTokens--;
+
+    /* -n returns as soon as any of the jobs is done */
+    if (numTokens > 0 && strcmp(argv[0], "-n") == 0) {
+        any = 1;
+        argv++;
+        numTokens--;
+    }
+
+    targets = malloc(((numTokens > 0 ? numTokens : activeJobs) + 1) * sizeof(job *));
+
+    if (numTokens == 0) {
+        for (current = jobListHead; current != NULL; current = current->next) {
+            targets[numTargets++] = current;
+        }
+    }
+
+    for (i = 0; i < numTokens; i++) {
+        int jid = stringToJobId(argv[i]);
+
+        if (jid == -1) {
+            printf("wait: invalid job id: %s\n", argv[i]);
+            free(targets);
+            return 2;
+        }
+
+        if ((current = findJob(jid)) != NULL) {
+            targets[numTargets++] = current;
+            givenStatus = -1;
+        } else if (jid >= 1 && jid <= JOBS_CAPACITY && finishedStatus[jid] >= 0) {
+            /* finished and cleaned up already */
+            givenStatus = finishedStatus[jid];
+            if (any && !found) {
+                status = givenStatus;
+                found = 1;
+            }
+        } else {
+            printf("wait: job not found: %s\n", argv[i]);
+            free(targets);
+            return 127;
+        }
+    }
+
+    for (i = 0; i < numTargets; i++) {
+        current = targets[i];
+
+        if (current->state == RUNNING && !current->waited) {
+            current->waited = 1;
+            remaining++;
+        } else if (current->state != RUNNING && any && !found) {
+            /* done (or stopped) already */
+            status = jobStatus(current);
+            found = 1;
+        }
+    }
+
+    interrupted = 0;
+
+    /* jobs that finish are appended to the completion queue, so only the
+     * part of it after seen needs looking at */
+    while (remaining > 0 && !found) {
+        struct pollfd fds;
+
+        fds.fd = childEventFd;
+        fds.events = POLLIN;
+        if (poll(&fds, 1, -1) < 0) {
+            if (errno == EINTR && interrupted) {
+                break;
+            }
+            continue;
+        }
+
+        if (!drainChildEvents()) {
+            continue;
+        }
+        reapChildren();
+
+        for (current = seen == NULL ? doneHead : seen->doneNext; current != NULL; current = current->doneNext) {
+            if (current->waited) {
+                current->waited = 0;
+                remaining--;
+
+                if (any && !found) {
+                    status = jobStatus(current);
+                    found = 1;
+                }
+            }
+            seen = current;
+        }
+    }
+
+    for (i = 0; i < numTargets; i++) {
+        targets[i]->waited = 0;
+    }
+
+    if (interrupted) {
+        status = 128 + SIGINT;
+    } else if (!any && numTokens > 0) {
+        /* the status of the last job given, like sh */
+        status = givenStatus >= 0 ? givenStatus : jobStatus(targets[numTargets - 1]);
+    }
+
+    free(targets);
+    return status;
+}
+
+builtin *findBuiltin(char *name) {
+    int length = strlen(name);
+    int index;
+
+    if (length == 0) {
+        return NULL;
+    }
+
+    /* the length and the first and last characters pick the only candidate */
+    switch (BUILTIN_KEY(length, name[0], name[length - 1])) {
+    case BUILTIN_KEY(2, 'b', 'g'):
+        index = BUILTIN_BG;
+        break;
+    case BUILTIN_KEY(2, 'c', 'd'):
+        index = BUILTIN_CD;
+        break;
+    case BUILTIN_KEY(4, 'e', 'c'):
+        index = BUILTIN_EXEC;
+        break;
+    case BUILTIN_KEY(4, 'e', 't'):
+        index = BUILTIN_EXIT;
+        break;
+    case BUILTIN_KEY(6, 'e', 't'):
+        index = BUILTIN_EXPORT;
+        break;
+    case BUILTIN_KEY(2, 'f', 'g'):
+        index = BUILTIN_FG;
+        break;
+    case BUILTIN_KEY(4, 'h', 'h'):
+        index = BUILTIN_HASH;
+        break;
+    case BUILTIN_KEY(4, 'j', 's'):
+        index = BUILTIN_JOBS;
+        break;
+    case BUILTIN_KEY(4, 'k', 'l'):
+        index = BUILTIN_KILL;
+        break;
+    case BUILTIN_KEY(5, 'l', 't'):
+        index = BUILTIN_LIMIT;
+        break;
+    case BUILTIN_KEY(8, 'p', 'l'):
+        index = BUILTIN_PARALLEL;
+        break;
+    case BUILTIN_KEY(3, 'p', 'n'):
+        index = BUILTIN_PIN;
+        break;
+    case BUILTIN_KEY(4, 't', 'e'):
+        index = BUILTIN_TIME;
+        break;
+    case BUILTIN_KEY(5, 't', 'e'):
+        index = BUILTIN_TRACE;
+        break;
+    case BUILTIN_KEY(5, 'u', 't'):
+        index = BUILTIN_UNSET;
+        break;
+    case BUILTIN_KEY(4, 'w', 't'):
+        index = BUILTIN_WAIT;
+        break;
+    default:
+        return NULL;
+    }
+
+    if (memcmp(builtins[index].name, name, length) != 0) {
+        return NULL;
+    }
+
+    return &builtins[index];
+}
+
+int runBuiltin(builtin *b, char **argv, int numTokens, int bgProcess) {
+    if ((b->flags & BUILTIN_USES_JOBS) && drainChildEvents()) {
+        reapChildren();
+    }
+
+    if (b->flags & BUILTIN_MAY_EXIT) {
+        fflush(stdout);
+    }
+
+    if (b->prefix != NULL) {
+        return b->prefix(argv, numTokens, bgProcess);
+    }
+
+    return b->func(argv, numTokens);
+}
+
+int executeCommand(char **tokens, int numTokens, int bgProcess) {
+    stage *stages;
+    int numStages;
+    builtin *b;
+    int assignments;
+    placement storage;
+
+    /* assignments without a command, or before a builtin (which runs in the
+     * shell), are the shell's own. Before other commands, or a builtin that
+     * runs them, they are only for the environment of those (see
+     * splitPipeline()) */
+    for (assignments = 0; assignments < numTokens && assignmentName(tokens[assignments]) > 0; assignments++);
+    b = assignments < numTokens ? findBuiltin(tokens[assignments]) : NULL;
+    if (assignments > 0 && b != NULL && (b->flags & BUILTIN_RUNS_COMMANDS)) {
+        savedVariable *saved = exportAssignments(&lineArena, tokens, assignments);
+        int status = executeCommand(tokens + assignments, numTokens - assignments, bgProcess);
+
+        restoreVariables(tokens, saved, assignments);
+        return status;
+    }
+    if (assignments > 0 && (assignments == numTokens || b != NULL)) {
+        int i;
+
+        for (i = 0; i < assignments; i++) {
+            size_t nameLength = assignmentName(tokens[i]);
+
+            setVariable(tokens[i], nameLength, tokens[i] + nameLength + 1, 0);
+        }
+        if (assignments == numTokens) {
+            return 0;
+        }
+        tokens += assignments;
+        numTokens -= assignments;
+    }
+
+    b = findBuiltin(tokens[0]);
+
+    /* prefixes apply to the whole pipeline after them (and need the shell
+     * to still be there afterwards) */
+    if (b != NULL && b->prefix != NULL) {
+        execLastCommand = 0;
+        return runBuiltin(b, tokens, numTokens, bgProcess);
+    }
+
+    if ((numStages = splitPipeline(&lineArena, tokens, numTokens, &stages)) < 0) {
+        return 2;
+    }
+
+    if (numStages > 1) {
+        /* pipelines only run external commands */
+        if (resolveStages(stages, numStages) != 0) {
+            return 127;
+        }
+        return runCommand(stages, numStages, numTokens, tokens, bgProcess);
+    }
+
+    if (b != NULL) {
+        int *saved;
+        int status;
+
+        if (stages[0].numRedirs == 0) {
+            return runBuiltin(b, tokens, numTokens, bgProcess);
+        }
+
+        /* builtins run in the shell, so its own fds are redirected meanwhile */
+        saved = arenaAlloc(&lineArena, stages[0].numRedirs * sizeof(int));
+        if (openRedirections(stages, 1) < 0) {
+            return 1;
+        }
+        if (applyRedirections(&stages[0], saved) < 0) {
+            closeRedirections(stages, 1);
+            return 1;
+        }
+
+        status = runBuiltin(b, stages[0].argv, stages[0].argc, bgProcess);
+
+        restoreRedirections(&stages[0], saved);
+        closeRedirections(stages, 1);
+        return status;
+    }
+
+    if (resolveStages(stages, 1) != 0) {
+        return 127;
+    }
+
+    /* nothing is left to do after the last command of a script, so it may
+     * as well replace the shell instead of being waited for. Not when it
+     * would get a cgroup or a placement, which only a launch applies */
+    if (execLastCommand && !bgProcess && activeJobs == 0 && cgroupRootFd < 0 && jobPlacement(bgProcess, &storage) == NULL) {
+        return execStage(&stages[0]);
+    }
+
+    return runCommand(stages, 1, numTokens, tokens, bgProcess);
+}
+
+int execFunc(char **argv, int numTokens, int bgProcess) {
+    stage *stages;
+    int numStages;
+    int status;
+
+    if (numTokens == 1) {
+        return 0;
+    }
+
+    if ((numStages = splitPipeline(&lineArena, argv + 1, numTokens - 1, &stages)) < 0) {
+        return 2;
+    }
+
+    if (numStages > 1) {
+        puts("exec: can't replace the shell with a pipeline");
+        return 2;
+    }
+
+    if (resolveStages(stages, 1) != 0) {
+        return 127;
+    }
+
+    status = execStage(&stages[0]);
+
+    /* a script doesn't go on once the shell was to be replaced */
+    if (!interactive) {
+        exit(status);
+    }
+    return status;
+}
+
+int pinFunc(char **argv, int numTokens, int bgProcess) {
+    placement place;
+    char *cpuList = NULL;
+    int status;
+    int i;
+
+    memset(&place, 0, sizeof(place));
+    place.node = -1;
+
+    if (numTokens == 1) {
+        printf("pin: policy %s\n", roundRobinNodes ? "round-robin" : "none");
+        return 0;
+    }
+
+    /* the shell-wide policy for background jobs */
+    if (strcmp(argv[1], "--policy") == 0) {
+        if (numTokens != 3 || (strcmp(argv[2], "round-robin") != 0 && strcmp(argv[2], "none") != 0)) {
+            puts("pin: usage: pin --policy round-robin|none");
+            return 2;
+        }
+        roundRobinNodes = strcmp(argv[2], "round-robin") == 0;
+        return 0;
+    }
+
+    for (i = 1; i < numTokens && argv[i][0] == '-'; i += 2) {
+        char *end;
+
+        if (strcmp(argv[i], "--cpus") != 0 && strcmp(argv[i], "--node") != 0) {
+            printf("pin: invalid option: %s\n", argv[i]);
+            return 2;
+        }
+
+        if (i + 1 == numTokens) {
+            printf("pin: %s: option requires an argument\n", argv[i]);
+            return 2;
+        }
+
+        if (strcmp(argv[i], "--cpus") == 0) {
+            if (parseCpuList(argv[i + 1], place.cpus) < 0) {
+                printf("pin: invalid cpu list: %s\n", argv[i + 1]);
+                return 1;
+            }
+            place.hasCpus = 1;
+            cpuList = argv[i + 1];
+        } else if (strcmp(argv[i], "--node") == 0) {
+            place.node = strtol(argv[i + 1], &end, 10);
+            if (end == argv[i + 1] || *end != '\0' || place.node < 0 || place.node >= numNodes()) {
+                printf("pin: no such node: %s\n", argv[i + 1]);
+                return 1;
+            }
+            place.bind = 1;
+        }
+    }
+
+    if (i == numTokens) {
+        puts("pin: usage: pin [--cpus LIST] [--node N] command [args...]");
+        return 2;
+    }
+
+    /* a node without cpus runs on the node's */
+    if (!place.hasCpus && place.node >= 0) {
+        nodeCpus(place.node, &place);
+    } else if (cpuList != NULL) {
+        snprintf(place.description, sizeof(place.description), "cpus %s", cpuList);
+    }
+    if (place.node >= 0) {
+        size_t length = strlen(place.description);
+
+        snprintf(place.description + length, sizeof(place.description) - length, " node %d", place.node);
+    }
+
+    linePlacement = &place;
+    status = executeCommand(argv + i, numTokens - i, bgProcess);
+    linePlacement = NULL;
+
+    return status;
+}
+
+int timeFunc(char **argv, int numTokens, int bgProcess) {
+    struct timespec start, end;
+    struct rusage selfBefore, selfAfter, childrenBefore, childrenAfter;
+    struct timeval user, sys;
+    int finishedBefore = finishedForegroundJobs;
+    int verbose = 0;
+    int status = 0;
+
+    if (numTokens > 1 && strcmp(argv[1], "-v") == 0) {
+        verbose = 1;
+        argv++;
+        numTokens--;
+    }
+
+    getrusage(RUSAGE_SELF, &selfBefore);
+    getrusage(RUSAGE_CHILDREN, &childrenBefore);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (numTokens > 1) {
+        status = executeCommand(argv + 1, numTokens - 1, bgProcess);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &selfAfter);
+    getrusage(RUSAGE_CHILDREN, &childrenAfter);
+
+    /* cpu time of the shell itself (builtins) plus the children waited for */
+    timersub(&selfAfter.ru_utime, &selfBefore.ru_utime, &user);
+    timersub(&selfAfter.ru_stime, &selfBefore.ru_stime, &sys);
+    timeradd(&user, &childrenAfter.ru_utime, &user);
+    timersub(&user, &childrenBefore.ru_utime, &user);
+    timeradd(&sys, &childrenAfter.ru_stime, &sys);
+    timersub(&sys, &childrenBefore.ru_stime, &sys);
+
+    printTime("real", elapsedSeconds(&start, &end));
+    printTime("user", user.tv_sec + user.tv_usec / 1e6);
+    printTime("sys", sys.tv_sec + sys.tv_usec / 1e6);
+
+    if (verbose && finishedForegroundJobs != finishedBefore) {
+        printf("maxrss\t%ldKB\n", lastJobUsage.ru_maxrss);
+        printf("faults\t%ld minor %ld major\n", lastJobUsage.ru_minflt, lastJobUsage.ru_majflt);
+        printf("ctxsw\t%ld voluntary %ld involuntary\n", lastJobUsage.ru_nvcsw, lastJobUsage.ru_nivcsw);
+    }
+
+    return status;
+}
+
+double elapsedSeconds(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void printTime(char *label, double seconds) {
+    int minutes = seconds / 60;
+
+    printf("%s\t%dm%.3fs\n", label, minutes, seconds - minutes * 60);
+}
+
+int runCommand(stage *stages, int numStages, int argc, char **argv, int bgProcess) {
+    job *j;
+
+    if (activeJobs == JOBS_CAPACITY) {
+        puts("job table full");
+        return 1;
+    }
+
+    if (openRedirections(stages, numStages) < 0) {
+        return 1;
+    }
+
+    /* keep the shell's own output ordered with the children's */
+    fflush(stdout);
+
+    if ((j = launchJob(stages, numStages, argc, argv, bgProcess, !bgProcess && interactive)) == NULL) {
+        return errno == ENOENT ? 127 : 126;
+    }
+
+    if (bgProcess) {
+        if (interactive) {
+            printf("[%d] %d\n", j->id, j->pgid);
+        }
+        return 0;
+    }
+
+    waitForJob(j);
+    return jobStatus(j);
+}
+
+int execStage(stage *s) {
+    int *saved = arenaAlloc(&lineArena, (s->numRedirs > 0 ? s->numRedirs : 1) * sizeof(int));
+    sigset_t blocked;
+    int error;
+
+    if (openRedirections(s, 1) < 0) {
+        return 1;
+    }
+    if (applyRedirections(s, saved) < 0) {
+        closeRedirections(s, 1);
+        return 1;
+    }
+
+    /* the command gets what a child would, the shell's own fds are all
+     * close-on-exec */
+    fflush(stdout);
+    signal(SIGTTOU, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &shellMask, &blocked);
+
+    /* the shell doesn't get to exit, so the trace is written now */
+    TRACE(TRACE_EXEC, 0, 0);
+    if (traceFile != NULL) {
+        dumpTrace(traceFile, chromeTracePath(traceFile));
+    }
+
+#ifdef EXEC_BY_FD
+    if (s->execFd >= 0) {
+        fexecve(s->execFd, s->argv, s->env != NULL ? s->env : environ);
+    }
+#endif
+    execve(s->command, s->argv, s->env != NULL ? s->env : environ);
+
+    /* still here, put the shell back */
+    error = errno;
+    sigprocmask(SIG_SETMASK, &blocked, NULL);
+    signal(SIGTTOU, SIG_IGN);
+    restoreRedirections(s, saved);
+    closeRedirections(s, 1);
+
+    printf("%s: %s\n", s->command, strerror(error));
+    return error == ENOENT ? 127 : 126;
+}
+
+job *launchJob(stage *stages, int numStages, int argc, char **argv, int bgProcess, int foreground) {
+    job *j;
+    pid_t pgid = 0;
+    int pipeSize = pipeBufferSize();
+    char *cgroup = NULL;
+    int cgroupFd = -1;
+    placement storage;
+    placement *place = jobPlacement(bgProcess, &storage);
+    int launched;
+    int i;
+
+    for (i = 0; i < numStages; i++) {
+        stages[i].place = place;
+    }
+
+    /* the whole pipeline shares one leaf */
+    if (cgroupRootFd >= 0 && (cgroupFd = createJobCgroup(&cgroup)) >= 0) {
+        for (i = 0; i < numStages; i++) {
+            stages[i].cgroupFd = cgroupFd;
+        }
+    }
+
+    for (launched = 0; launched < numStages; launched++) {
+        stage *current = &stages[launched];
+        int fds[2] = { -1, -1 };
+        pid_t pid;
+
+        if (launched < numStages - 1) {
+            if (makePipe(fds, pipeSize) < 0) {
+                printf("pipe: %s\n", strerror(errno));
+                break;
+            }
+            current->outFd = fds[1];
+        }
+
+        TRACE(TRACE_LAUNCH_BEGIN, 0, launched);
+        pid = launchProcess(current, pgid, foreground, &shellMask);
+        TRACE(TRACE_LAUNCH_END, pid, pid < 0 ? errno : 0);
+
+        /* the children have their own copies of the pipes now (the first
+         * stage's input belongs to the caller) */
+        if (launched > 0 && current->inFd >= 0) {
+            close(current->inFd);
+        }
+        if (current->outFd >= 0) {
+            close(current->outFd);
+        }
+
+        if (pid < 0) {
+            /* failed to fork/exec, earlier stages see a closed pipe */
+            int error = errno;
+
+            printf("%s: %s\n", current->command, strerror(errno));
+            if (fds[0] >= 0) {
+                close(fds[0]);
+            }
+            errno = error;
+            break;
+        }
+
+        if (pgid == 0) {
+            /* the first stage leads the process group */
+            pgid = pid;
+
+            /* hand over the terminal before later stages start reading it */
+            if (foreground) {
+                tcsetpgrp(STDIN_FILENO, pgid);
+                TRACE(TRACE_TCSETPGRP, pgid, 0);
+            }
+        }
+
+        current->pid = pid;
+        if (launched < numStages - 1) {
+            stages[launched + 1].inFd = fds[0];
+        }
+    }
+
+    /* the children have their own copies of the redirections too */
+    closeRedirections(stages, numStages);
+    if (cgroupFd >= 0) {
+        close(cgroupFd);
+    }
+
+    if (launched == 0) {
+        if (cgroup != NULL) {
+            removeJobCgroup(cgroup);
+        }
+        return NULL;
+    }
+
+    j = createJob(internString(stages[0].command), joinString(argc, argv), pgid, RUNNING, bgProcess, launched);
+    j->cgroup = cgroup;
+    if (place != NULL) {
+        j->placement = strdup(place->description);
+    }
+    for (i = 0; i < launched; i++) {
+        j->procs[i].pid = stages[i].pid;
+    }
+    addJob(j);
+
+    return j;
+}
+
+int makePipe(int fds[2], int size) {
+#ifdef __linux__
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        return -1;
+    }
+
+    if (size > 0) {
+        /* best effort, the kernel caps it at /proc/sys/fs/pipe-max-size */
+        fcntl(fds[1], F_SETPIPE_SZ, size);
+    }
+#else
+    if (pipe(fds) < 0) {
+        return -1;
+    }
+
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+    return 0;
+}
+
+int pipeBufferSize() {
+    char *value = getenv("SHELL_PIPE_SIZE");
+
+    if (value == NULL) {
+        return 0;
+    }
+
+    return atoi(value);
+}
+
+pid_t launchProcess(stage *s, pid_t pgid, int foreground, sigset_t *childMask) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    short flags = POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    sigset_t defaults;
+    pid_t pid;
+    int error;
+    int i;
+#ifdef EXEC_BY_FD
+    char fdPath[32];
+#endif
+
+    /* spawn attributes can't pick a cgroup or cpus */
+    if (s->cgroupFd >= 0 || s->place != NULL) {
+        return forkProcess(s, pgid, foreground, childMask);
+    }
+
+#ifdef ZYGOTE_LAUNCHER
+    /* the launcher keeps the shell's environment, so a command with
+     * assignments of its own is spawned here */
+    if (zygoteFd >= 0 && s->env == NULL && zygoteLaunch(s, pgid, foreground, &pid) == 0) {
+        TRACE(TRACE_SPAWN, pid, 1);
+        return pid;
+    }
+#endif
+
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTTOU);
+
+    /* posix_spawn doesn't copy the shell's page tables (which are large with
+     * ASan) the way fork does, so launch latency stays flat as the heap grows */
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setsigmask(&attr, childMask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+
+#ifdef POSIX_SPAWN_TCSETPGROUP
+    /* the child takes the terminal itself, before it can read from it */
+    if (foreground && pgid == 0) {
+        flags |= POSIX_SPAWN_TCSETPGROUP;
+        posix_spawnattr_tcsetpgrp_np(&attr, STDIN_FILENO);
+    }
+#endif
+    posix_spawnattr_setflags(&attr, flags);
+
+    /* dup2 clears close-on-exec on the copies, the originals still close */
+    posix_spawn_file_actions_init(&actions);
+    if (s->inFd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, s->inFd, STDIN_FILENO);
+    }
+    if (s->outFd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, s->outFd, STDOUT_FILENO);
+    }
+    for (i = 0; i < s->numRedirs; i++) {
+        redirection *r = &s->redirs[i];
+
+        posix_spawn_file_actions_adddup2(&actions, r->openFd >= 0 ? r->openFd : r->op->dupFd, r->op->fd);
+    }
+
+    error = ENOENT;
+#ifdef EXEC_BY_FD
+    /* spawn only takes paths, this one leads to the file the lookup opened
+     * (the child has its own copy of the fd until the exec) */
+    if (s->execFd >= 0) {
+        snprintf(fdPath, sizeof(fdPath), "/proc/self/fd/%d", s->execFd);
+        error = posix_spawn(&pid, fdPath, &actions, &attr, s->argv, s->env != NULL ? s->env : environ);
+    }
+#endif
+    /* by path without an fd, or without /proc */
+    if (error == ENOENT) {
+        error = posix_spawn(&pid, s->command, &actions, &attr, s->argv, s->env != NULL ? s->env : environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (error == 0) {
+        TRACE(TRACE_SPAWN, pid, 0);
+        return pid;
+    }
+
+    if (error == ENOSYS || error == EINVAL) {
+        /* spawn attributes not supported here */
+        return forkProcess(s, pgid, foreground, childMask);
+    }
+
+    errno = error;
+    return -1;
+}
+
+pid_t forkProcess(stage *s, pid_t pgid, int foreground, sigset_t *childMask) {
+    pid_t pid = -1;
+    int moveToCgroup = s->cgroupFd >= 0;
+    int i;
+
+    /* or the child would write out the shell's pending output again */
+    fflush(stdout);
+
+#ifdef CGROUP_CLONE
+    /* straight into the job's cgroup, so not even the first instructions
+     * run outside it */
+    if (s->cgroupFd >= 0 && (pid = cloneIntoCgroup(s->cgroupFd)) >= 0) {
+        moveToCgroup = 0;
+    }
+#endif
+    if (pid < 0) {
+        pid = fork();
+    }
+
+    /* child process */
+    if (pid == 0) {
+        /* the child moves itself, before it can start anything else */
+        if (moveToCgroup) {
+            writeCgroup(s->cgroupFd, "cgroup.procs", "0");
+        }
+
+        setpgid(0, pgid);
+
+        /* SIGTTOU is still ignored here */
+        if (foreground && pgid == 0) {
+            tcsetpgrp(STDIN_FILENO, getpid());
+        }
+
+        if (s->place != NULL) {
+            applyPlacement(s->place);
+        }
+
+        signal(SIGTTOU, SIG_DFL);
+        sigprocmask(SIG_SETMASK, childMask, NULL);
+
+        if (s->inFd >= 0) {
+            dup2(s->inFd, STDIN_FILENO);
+        }
+        if (s->outFd >= 0) {
+            dup2(s->outFd, STDOUT_FILENO);
+        }
+        for (i = 0; i < s->numRedirs; i++) {
+            redirection *r = &s->redirs[i];
+
+            dup2(r->openFd >= 0 ? r->openFd : r->op->dupFd, r->op->fd);
+        }
+
+#ifdef EXEC_BY_FD
+        /* by path only if that fails (no /proc for fexecve to fall back on) */
+        if (s->execFd >= 0) {
+            fexecve(s->execFd, s->argv, s->env != NULL ? s->env : environ);
+        }
+#endif
+        if (execve(s->command, s->argv, s->env != NULL ? s->env : environ) != 0) {
+            printf("%s: %s\n", s->command, strerror(errno));
+            exit(errno);
+        }
+    }
+
+    if (pid > 0) {
+        TRACE(TRACE_FORK, pid, 0);
+        setpgid(pid, pgid == 0 ? pid : pgid);
+    }
+
+    return pid;
+}
+
+#ifdef ZYGOTE_LAUNCHER
+void initZygote() {
+    char *value = getenv("SHELL_ZYGOTE");
+    int fds[2];
+    pid_t pid;
+
+    if (value == NULL || value[0] == '\0' || strcmp(value, "0") == 0) {
+        return;
+    }
+
+    /* one message per request, so requests never need framing */
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+        return;
+    }
+
+    fflush(stdout);
+    if ((pid = fork()) == 0) {
+        close(fds[0]);
+        runZygote(fds[1]);
+        _exit(0);
+    }
+    close(fds[1]);
+
+    if (pid < 0) {
+        close(fds[0]);
+        return;
+    }
+
+    /* the launcher inherited the environment, changes count from here */
+    zygoteFd = fds[0];
+    zygotePid = pid;
+    zygoteGeneration = environGeneration;
+}
+
+int zygoteLaunch(stage *s, pid_t pgid, int foreground, pid_t *pid) {
+    static char message[ZYGOTE_MAX_REQUEST];
+    launchRequest *request = (launchRequest *) message;
+    launchAction *actions = (launchAction *) (message + sizeof(launchRequest));
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+    } control;
+    struct msghdr header;
+    struct cmsghdr *rights;
+    struct iovec part;
+    launchReply reply;
+    int fds[ZYGOTE_MAX_FDS];
+    int numFds = 0;
+    int cwdFd = -1;
+    int syncing = environGeneration != zygoteGeneration;
+    char *end, *limit = message + sizeof(message);
+    int i;
+
+    /* a directory fd plus the standard fds plus the redirections plus the
+     * executable */
+    if (1 + 3 + s->numRedirs + 1 > ZYGOTE_MAX_FDS) {
+        return -1;
+    }
+
+    request->pgid = pgid;
+    request->foreground = foreground;
+    request->argc = s->argc;
+    request->numActions = 0;
+    request->numChanges = 0;
+    request->changeCwd = 0;
+
+    if (syncing) {
+        if ((cwdFd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+            fds[numFds++] = cwdFd;
+            request->changeCwd = 1;
+        }
+    }
+
+    /* the standard fds always go along, since the shell's own may be
+     * redirected (for a builtin) while it launches */
+    for (i = 0; i < 3; i++) {
+        int fd = i == STDIN_FILENO && s->inFd >= 0 ? s->inFd : i == STDOUT_FILENO && s->outFd >= 0 ? s->outFd : i;
+
+        actions[request->numActions++] = (launchAction) { i, numFds, 1 };
+        fds[numFds++] = fd;
+    }
+    for (i = 0; i < s->numRedirs; i++) {
+        redirection *r = &s->redirs[i];
+
+        if (r->openFd >= 0) {
+            actions[request->numActions++] = (launchAction) { r->op->fd, numFds, 1 };
+            fds[numFds++] = r->openFd;
+        } else {
+            actions[request->numActions++] = (launchAction) { r->op->fd, r->op->dupFd, 0 };
+        }
+    }
+
+    /* the launcher execs the file the lookup opened too, not the path */
+    request->execFd = -1;
+    if (s->execFd >= 0) {
+        request->execFd = numFds;
+        fds[numFds++] = s->execFd;
+    }
+
+    end = (char *) (actions + request->numActions);
+    for (i = -1; i < s->argc; i++) {
+        char *string = i < 0 ? s->command : s->argv[i];
+        size_t length = strlen(string) + 1;
+
+        if (end + length > limit) {
+            if (cwdFd >= 0) {
+                close(cwdFd);
+            }
+            return -1;
+        }
+        memcpy(end, string, length);
+        end += length;
+    }
+
+    if (syncing && (request->numChanges = environChanges(&end, limit)) < 0) {
+        if (cwdFd >= 0) {
+            close(cwdFd);
+        }
+        return -1;
+    }
+
+    part.iov_base = message;
+    part.iov_len = end - message;
+
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &part;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buffer;
+    header.msg_controllen = CMSG_SPACE(numFds * sizeof(int));
+
+    rights = CMSG_FIRSTHDR(&header);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(numFds * sizeof(int));
+    memcpy(CMSG_DATA(rights), fds, numFds * sizeof(int));
+
+    while (sendmsg(zygoteFd, &header, MSG_NOSIGNAL) < 0) {
+        if (errno == EINTR) {
+            continue;
+        }
+
+        /* the launcher is gone (or the fds were bad), launch in the shell */
+        if (errno != EBADF) {
+            close(zygoteFd);
+            zygoteFd = -1;
+            reapZygote();
+        }
+        if (cwdFd >= 0) {
+            close(cwdFd);
+        }
+        return -1;
+    }
+
+    if (cwdFd >= 0) {
+        close(cwdFd);
+    }
+
+    while (recv(zygoteFd, &reply, sizeof(reply), 0) != sizeof(reply)) {
+        if (errno == EINTR) {
+            continue;
+        }
+        close(zygoteFd);
+        zygoteFd = -1;
+        reapZygote();
+        return -1;
+    }
+
+    if (reply.pid == 0) {
+        /* the launcher is still where it was, the next request tries again */
+        errno = reply.error;
+        return -1;
+    }
+
+    if (syncing) {
+        /* the launcher has the current environment now */
+        for (i = 0; i < numChangedNames; i++) {
+            variable *v = findVariable(changedNames[i], strlen(changedNames[i]));
+
+            if (v != NULL) {
+                v->changed = 0;
+            }
+            free(changedNames[i]);
+        }
+        numChangedNames = 0;
+        zygoteGeneration = environGeneration;
+    }
+
+    if (reply.error != 0) {
+        /* the child is the shell's, and already exiting */
+        if (reply.pid > 0) {
+            waitpid(reply.pid, NULL, 0);
+        }
+        errno = reply.error;
+        *pid = -1;
+        return 0;
+    }
+
+    *pid = reply.pid;
+    return 0;
+}
+
+int environChanges(char **end, char *limit) {
+    int i;
+
+    for (i = 0; i < numChangedNames; i++) {
+        char *name = changedNames[i];
+        variable *v = findVariable(name, strlen(name));
+        char *change = v != NULL && v->envIndex >= 0 ? v->entry : name;
+        size_t length = strlen(change) + 1;
+
+        if (*end + length > limit) {
+            return -1;
+        }
+        memcpy(*end, change, length);
+        *end += length;
+    }
+
+    return numChangedNames;
+}
+
+void reapZygote() {
+    if (zygotePid > 0 && waitpid(zygotePid, NULL, WNOHANG) != 0) {
+        zygotePid = -1;
+    }
+}
+
+void runZygote(int fd) {
+    static char message[ZYGOTE_MAX_REQUEST];
+    static char *argv[ZYGOTE_MAX_REQUEST / 2];
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+    } control;
+    launchRequest *request = (launchRequest *) message;
+    launchAction *actions = (launchAction *) (message + sizeof(launchRequest));
+
+    /* job control keys at the terminal are for the jobs, not the launcher */
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    while (1) {
+        struct msghdr header;
+        struct cmsghdr *rights;
+        struct iovec part;
+        launchReply reply;
+        int fds[ZYGOTE_MAX_FDS];
+        int numFds = 0;
+        int statusFds[2];
+        char *string;
+        ssize_t length;
+        int i;
+
+        part.iov_base = message;
+        part.iov_len = sizeof(message);
+
+        memset(&header, 0, sizeof(header));
+        header.msg_iov = &part;
+        header.msg_iovlen = 1;
+        header.msg_control = control.buffer;
+        header.msg_controllen = sizeof(control.buffer);
+
+        if ((length = recvmsg(fd, &header, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+            continue;
+        }
+        if (length < (ssize_t) sizeof(launchRequest)) {
+            /* the shell exited */
+            return;
+        }
+
+        for (rights = CMSG_FIRSTHDR(&header); rights != NULL; rights = CMSG_NXTHDR(&header, rights)) {
+            if (rights->cmsg_level == SOL_SOCKET && rights->cmsg_type == SCM_RIGHTS) {
+                numFds = (rights->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                memcpy(fds, CMSG_DATA(rights), numFds * sizeof(int));
+            }
+        }
+
+        /* the command, its arguments and the environment changes */
+        string = (char *) (actions + request->numActions);
+        for (i = -1; i < request->argc; i++) {
+            argv[i + 1] = string;
+            string += strlen(string) + 1;
+        }
+        argv[request->argc + 1] = NULL;
+
+        for (i = 0; i < request->numChanges; i++) {
+            size_t size = strlen(string) + 1;
+            char *value = strchr(string, '=');
+
+            /* setenv() owns its copies, a strdup() for putenv() would leak each one */
+            if (value != NULL) {
+                *value++ = '\0';
+                setenv(string, value, 1);
+            } else {
+                unsetenv(string);
+            }
+            string += size;
+        }
+
+        reply.error = 0;
+        if (request->changeCwd && fchdir(fds[0]) < 0) {
+            /* not in some other directory, the shell starts it where it is */
+            reply.pid = 0;
+            reply.error = errno;
+        } else if (pipe2(statusFds, O_CLOEXEC) < 0) {
+            reply.pid = -1;
+            reply.error = errno;
+        } else if ((reply.pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0)) == 0) {
+            close(statusFds[0]);
+            zygoteChild(request, actions, fds, argv, statusFds[1]);
+        } else {
+            /* the status pipe closes without a word once the exec worked */
+            close(statusFds[1]);
+            if (reply.pid < 0) {
+                reply.error = errno;
+            } else {
+                while (read(statusFds[0], &reply.error, sizeof(reply.error)) < 0 && errno == EINTR);
+            }
+            close(statusFds[0]);
+        }
+
+        for (i = 0; i < numFds; i++) {
+            close(fds[i]);
+        }
+
+        while (send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) < 0 && errno == EINTR);
+    }
+}
+
+void zygoteChild(launchRequest *request, launchAction *actions, int *fds, char **argv, int statusFd) {
+    pid_t pgid = request->pgid != 0 ? request->pgid : getpid();
+    int error;
+    int i;
+
+    setpgid(0, pgid);
+
+    /* SIGTTOU is still ignored here */
+    if (request->foreground && request->pgid == 0) {
+        tcsetpgrp(STDIN_FILENO, pgid);
+    }
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+
+    if (request->changeCwd) {
+        close(fds[0]);
+    }
+
+    for (i = 0; i < request->numActions; i++) {
+        launchAction *a = &actions[i];
+
+        dup2(a->passed ? fds[a->source] : a->source, a->fd);
+    }
+
+#ifdef EXEC_BY_FD
+    /* by path only if that fails, like forkProcess() */
+    if (request->execFd >= 0) {
+        fexecve(fds[request->execFd], argv + 1, environ);
+    }
+#endif
+    execv(argv[0], argv + 1);
+
+    error = errno;
+    while (write(statusFd, &error, sizeof(error)) < 0 && errno == EINTR);
+    _exit(127);
+}
+#endif
+
+void initCgroups() {
+    char *value = getenv("SHELL_CGROUP");
+    char path[PATH_MAX];
+
+    if (value == NULL || value[0] == '\0' || strcmp(value, "0") == 0) {
+        return;
+    }
+
+    if (value[0] == '/') {
+        snprintf(path, sizeof(path), "%s", value);
+    } else if (shellCgroup(path, sizeof(path)) < 0) {
+        return;
+    }
+
+    if ((cgroupRootFd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        printf("shell: %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    /* best effort, a cgroup with processes of its own (like the shell's)
+     * can't hand controllers down */
+    writeCgroup(cgroupRootFd, "cgroup.subtree_control", "+cpu");
+    writeCgroup(cgroupRootFd, "cgroup.subtree_control", "+memory");
+}
+
+int shellCgroup(char *path, size_t size) {
+    char line[PATH_MAX];
+    char mount[PATH_MAX] = "";
+    char group[PATH_MAX] = "";
+    FILE *file;
+
+    /* where the v2 hierarchy is mounted ("... - cgroup2 ...") */
+    if ((file = fopen("/proc/self/mountinfo", "re")) == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *separator = strstr(line, " - cgroup2 ");
+
+        if (separator != NULL && sscanf(line, "%*s %*s %*s %*s %s", mount) == 1) {
+            break;
+        }
+        mount[0] = '\0';
+    }
+    fclose(file);
+
+    /* and where in it the shell is ("0::/path") */
+    if ((file = fopen("/proc/self/cgroup", "re")) == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(group, sizeof(group), "%s", line + 3);
+            break;
+        }
+    }
+    fclose(file);
+
+    if (mount[0] == '\0' || group[0] == '\0') {
+        return -1;
+    }
+
+    return snprintf(path, size, "%s%s", mount, strcmp(group, "/") == 0 ? "" : group) < size ? 0 : -1;
+}
+
+int createJobCgroup(char **name) {
+    char leaf[64];
+    int fd;
+
+    snprintf(leaf, sizeof(leaf), "job.%d.%lu", getpid(), ++cgroupsCreated);
+
+    if (mkdirat(cgroupRootFd, leaf, 0755) < 0) {
+        return -1;
+    }
+
+    if ((fd = openat(cgroupRootFd, leaf, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        unlinkat(cgroupRootFd, leaf, AT_REMOVEDIR);
+        return -1;
+    }
+
+    *name = strdup(leaf);
+    return fd;
+}
+
+void removeJobCgroup(char *name) {
+    /* fails if something the job started is still around, which then
+     * keeps the cgroup */
+    unlinkat(cgroupRootFd, name, AT_REMOVEDIR);
+    free(name);
+}
+
+int writeCgroup(int dirFd, char *file, char *value) {
+    size_t length = strlen(value);
+    int fd = openat(dirFd, file, O_WRONLY | O_CLOEXEC);
+    ssize_t written;
+    int error;
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    /* cgroup files take a value per write */
+    written = write(fd, value, length);
+    error = errno;
+    close(fd);
+
+    errno = error;
+    return written == length ? 0 : -1;
+}
+
+int readCgroup(int dirFd, char *file, char *buffer, size_t size) {
+    int fd = openat(dirFd, file, O_RDONLY | O_CLOEXEC);
+    ssize_t bytesRead;
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    bytesRead = read(fd, buffer, size - 1);
+    close(fd);
+
+    if (bytesRead < 0) {
+        return -1;
+    }
+
+    buffer[bytesRead] = '\0';
+    return 0;
+}
+
+void cgroupUsage(job *j, char *buffer, size_t size) {
+    char file[PATH_MAX];
+    char value[4096];
+    char memory[32] = "-";
+    double cpu = 0;
+    char *usage;
+
+    snprintf(file, sizeof(file), "%s/cpu.stat", j->cgroup);
+    if (readCgroup(cgroupRootFd, file, value, sizeof(value)) == 0 && (usage = strstr(value, "usage_usec ")) != NULL) {
+        cpu = strtoll(usage + strlen("usage_usec "), NULL, 10) / 1e6;
+    }
+
+    /* only there with the memory controller enabled */
+    snprintf(file, sizeof(file), "%s/memory.current", j->cgroup);
+    if (readCgroup(cgroupRootFd, file, value, sizeof(value)) == 0) {
+        snprintf(memory, sizeof(memory), "%lldKB", strtoll(value, NULL, 10) / 1024);
+    }
+
+    snprintf(buffer, size, " cgroup %s cpu %.3fs mem %s", j->cgroup, cpu, memory);
+}
+
+#ifdef CGROUP_CLONE
+pid_t cloneIntoCgroup(int cgroupFd) {
+    struct clone_args args;
+
+    memset(&args, 0, sizeof(args));
+    args.flags = CLONE_INTO_CGROUP;
+    args.exit_signal = SIGCHLD;
+    args.cgroup = cgroupFd;
+
+    return syscall(SYS_clone3, &args, sizeof(args));
+}
+#endif
+
+placement *jobPlacement(int bgProcess, placement *storage) {
+    size_t length;
+    int nodes;
+
+    if (linePlacement != NULL) {
+        return linePlacement;
+    }
+
+    if (!roundRobinNodes || !bgProcess || (nodes = numNodes()) < 2) {
+        return NULL;
+    }
+
+    /* memory only prefers the node, so a full node doesn't mean OOM kills */
+    memset(storage, 0, sizeof(placement));
+    storage->node = nextNode++ % nodes;
+    storage->bind = 0;
+    nodeCpus(storage->node, storage);
+
+    length = strlen(storage->description);
+    snprintf(storage->description + length, sizeof(storage->description) - length, " node %d (preferred)", storage->node);
+
+    return storage;
+}
+
+int parseCpuList(char *list, unsigned long *mask) {
+    size_t bits = 8 * sizeof(unsigned long);
+    char *range = list;
+
+    memset(mask, 0, PLACEMENT_MAX_CPUS / 8);
+
+    while (1) {
+        char *end;
+        long first = strtol(range, &end, 10), last = first;
+        long cpu;
+
+        if (end == range || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            range = end + 1;
+            last = strtol(range, &end, 10);
+            if (end == range || last < first) {
+                return -1;
+            }
+        }
+        if (last >= PLACEMENT_MAX_CPUS) {
+            return -1;
+        }
+
+        for (cpu = first; cpu <= last; cpu++) {
+            mask[cpu / bits] |= 1UL << (cpu % bits);
+        }
+
+        if (*end == '\0' || *end == '\n') {
+            return 0;
+        }
+        if (*end != ',') {
+            return -1;
+        }
+        range = end + 1;
+    }
+}
+
+int nodeCpus(int node, placement *place) {
+    char path[PATH_MAX];
+    char list[sizeof(place->description) - 32];
+    int fd;
+    ssize_t length;
+
+    snprintf(path, sizeof(path), NODE_SYSFS "/node%d/cpulist", node);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    length = read(fd, list, sizeof(list) - 1);
+    close(fd);
+
+    if (length <= 0) {
+        return -1;
+    }
+    list[length] = '\0';
+    list[strcspn(list, "\n")] = '\0';
+
+    if (parseCpuList(list, place->cpus) < 0) {
+        return -1;
+    }
+    place->hasCpus = 1;
+    snprintf(place->description, sizeof(place->description), "cpus %s", list);
+
+    return 0;
+}
+
+int numNodes() {
+    static int nodes = 0;
+    unsigned long mask[PLACEMENT_MAX_CPUS / (8 * sizeof(unsigned long))];
+    char list[256];
+    ssize_t length;
+    int fd;
+    int i;
+
+    if (nodes > 0) {
+        return nodes;
+    }
+
+    /* the highest online node, +1 */
+    nodes = 1;
+    if ((fd = open(NODE_SYSFS "/online", O_RDONLY | O_CLOEXEC)) >= 0) {
+        if ((length = read(fd, list, sizeof(list) - 1)) > 0) {
+            list[length] = '\0';
+            if (parseCpuList(list, mask) == 0) {
+                for (i = 0; i < PLACEMENT_MAX_CPUS; i++) {
+                    if (mask[i / (8 * sizeof(unsigned long))] & (1UL << (i % (8 * sizeof(unsigned long))))) {
+                        nodes = i + 1;
+                    }
+                }
+            }
+        }
+        close(fd);
+    }
+
+    return nodes;
+}
+
+void applyPlacement(placement *place) {
+#ifdef __linux__
+    /* the masks have the cpu_set_t layout */
+    if (place->hasCpus && sched_setaffinity(0, sizeof(place->cpus), (cpu_set_t *) place->cpus) < 0) {
+        printf("pin: sched_setaffinity: %s\n", strerror(errno));
+    }
+
+#ifdef SYS_set_mempolicy
+    if (place->node >= 0) {
+        unsigned long nodes[PLACEMENT_MAX_CPUS / (8 * sizeof(unsigned long))];
+        size_t bits = 8 * sizeof(unsigned long);
+
+        memset(nodes, 0, sizeof(nodes));
+        nodes[place->node / bits] |= 1UL << (place->node % bits);
+
+        if (syscall(SYS_set_mempolicy, place->bind ? MPOL_BIND : MPOL_PREFERRED, nodes, PLACEMENT_MAX_CPUS) < 0) {
+            printf("pin: set_mempolicy: %s\n", strerror(errno));
+        }
+    }
+#endif
+#endif
+}
+
+int splitPipeline(arena *lineArena, char **tokens, int numTokens, stage **stages) {
+    int numStages = 1;
+    int start = 0;
+    int i, current;
+
+    for (i = 0; i < numTokens; i++) {
+        if (tokens[i] == pipeToken) {
+            numStages++;
+        }
+    }
+
+    *stages = arenaAlloc(lineArena, numStages * sizeof(stage));
+
+    for (current = 0, i = 0; i <= numTokens; i++) {
+        stage *s = &(*stages)[current];
+        int j;
+
+        if (i < numTokens && tokens[i] != pipeToken) {
+            continue;
+        }
+
+        /* every token may be a redirection (2>&1 takes no file) */
+        s->command = NULL;
+        s->argc = 0;
+        s->argv = arenaAlloc(lineArena, (i - start + 1) * sizeof(char*));
+        s->redirs = arenaAlloc(lineArena, (i - start + 1) * sizeof(redirection));
+        s->numRedirs = 0;
+        s->inFd = -1;
+        s->outFd = -1;
+        s->cgroupFd = -1;
+        s->execFd = -1;
+        s->place = NULL;
+        s->env = NULL;
+        s->searchPath = NULL;
+
+        for (j = start; j < i; j++) {
+            redirectOperator *op = findRedirect(tokens[j]);
+            redirection *r;
+
+            if (op == NULL) {
+                s->argv[s->argc++] = tokens[j];
+                continue;
+            }
+
+            r = &s->redirs[s->numRedirs++];
+            r->op = op;
+            r->target = NULL;
+            r->openFd = -1;
+
+            if (op->flags != -1) {
+                /* the next word is the file */
+                if (j + 1 == i || findRedirect(tokens[j + 1]) != NULL) {
+                    printf("syntax error near unexpected token `%s'\n", j + 1 < numTokens ? tokens[j + 1] : "newline");
+                    return -1;
+                }
+                r->target = tokens[++j];
+            }
+        }
+        s->argv[s->argc] = NULL;
+
+        /* NAME=value words before the command are for its environment */
+        for (j = 0; j < s->argc && assignmentName(s->argv[j]) > 0; j++) {
+            if (strncmp(s->argv[j], "PATH=", 5) == 0) {
+                s->searchPath = s->argv[j] + 5;
+            }
+        }
+        if (j > 0 && j < s->argc) {
+            s->env = overrideEnvironment(lineArena, s->argv, j);
+            s->argv += j;
+            s->argc -= j;
+        }
+
+        if (s->argc == 0) {
+            /* empty stage */
+            printf("syntax error near unexpected token `%s'\n", i < numTokens ? "|" : "newline");
+            return -1;
+        }
+
+        current++;
+        start = i + 1;
+    }
+
+    return numStages;
+}
+
+int openRedirections(stage *stages, int numStages) {
+    int i, j;
+
+    for (i = 0; i < numStages; i++) {
+        for (j = 0; j < stages[i].numRedirs; j++) {
+            redirection *r = &stages[i].redirs[j];
+
+            if (r->target == NULL) {
+                continue;
+            }
+
+            if ((r->openFd = open(r->target, r->op->flags | O_CLOEXEC, 0666)) < 0) {
+                printf("%s: %s\n", r->target, strerror(errno));
+                closeRedirections(stages, numStages);
+                return -1;
+            }
+
+            if (r->op->prealloc) {
+                preallocateOutput(r->openFd);
+            }
+        }
+    }
+
+    return 0;
+}
+
+void closeRedirections(stage *stages, int numStages) {
+    int i, j;
+
+    for (i = 0; i < numStages; i++) {
+        for (j = 0; j < stages[i].numRedirs; j++) {
+            if (stages[i].redirs[j].openFd >= 0) {
+                close(stages[i].redirs[j].openFd);
+                stages[i].redirs[j].openFd = -1;
+            }
+        }
+    }
+}
+
+void preallocateOutput(int fd) {
+#ifdef FALLOC_FL_KEEP_SIZE
+    char *value = getenv("SHELL_PREALLOC_SIZE");
+    off_t size = value != NULL ? strtoll(value, NULL, 10) : DEFAULT_PREALLOC_SIZE;
+
+    /* the blocks are reserved past the end of the file, which keeps its
+     * size, so writes that fit never have to allocate */
+    if (size > 0) {
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+    }
+#endif
+}
+
+int applyRedirections(stage *s, int *saved) {
+    int i;
+
+    fflush(stdout);
+
+    /* -2 marks the ones not applied (yet) */
+    for (i = 0; i < s->numRedirs; i++) {
+        saved[i] = -2;
+    }
+
+    for (i = 0; i < s->numRedirs; i++) {
+        redirection *r = &s->redirs[i];
+
+        /* -1 if the fd wasn't open to begin with */
+        saved[i] = fcntl(r->op->fd, F_DUPFD_CLOEXEC, 10);
+
+        if (dup2(r->openFd >= 0 ? r->openFd : r->op->dupFd, r->op->fd) < 0) {
+            printf("%s: %s\n", r->target != NULL ? r->target : r->op->token, strerror(errno));
+            restoreRedirections(s, saved);
+            return -1;
+        }
+
+        if (r->op->fd == STDIN_FILENO) {
+            stdinRedirected = 1;
+        }
+    }
+
+    return 0;
+}
+
+void restoreRedirections(stage *s, int *saved) {
+    int i;
+
+    fflush(stdout);
+
+    /* in reverse, so an fd redirected twice ends up as it started */
+    for (i = s->numRedirs - 1; i >= 0; i--) {
+        if (saved[i] == -2) {
+            continue;
+        }
+
+        if (saved[i] >= 0) {
+            dup2(saved[i], s->redirs[i].op->fd);
+            close(saved[i]);
+        } else {
+            close(s->redirs[i].op->fd);
+        }
+        saved[i] = -2;
+    }
+
+    stdinRedirected = 0;
+}
+
+int resolveStages(stage *stages, int numStages) {
+    int i;
+
+    for (i = 0; i < numStages; i++) {
+        char *name = stages[i].argv[0];
+
+        /* relative or absolute filepath */
+        if (strchr(name, '/') != NULL) {
+            if (!fileExists(name)) {
+                printf("%s: No such file or directory\n", name);
+                return -1;
+            }
+            stages[i].command = name;
+        } else if (stages[i].searchPath != NULL) {
+            /* a $PATH of its own, which the hash doesn't cover */
+            if ((stages[i].command = searchPath(name, stages[i].searchPath)) == NULL) {
+                printf("%s: command not found\n", name);
+                return -1;
+            }
+        } else {
+            /* search $PATH (through the command hash) */
+            hashEntry *entry;
+
+            if ((entry = resolveCommand(name)) == NULL) {
+                printf("%s: command not found\n", name);
+                return -1;
+            }
+
+            entry->hits++;
+            stages[i].command = entry->path;
+            stages[i].execFd = entry->script ? -1 : entry->fd;
+        }
+    }
+
+    return 0;
+}
+
+int parseTargets(char *name, char **operands, int numOperands, int accept, targetSet *set) {
+    unsigned char *named = NULL;
+    int states = 0;
+    job *current;
+    int i;
+
+    /* a single operand names each job once, only several can overlap */
+    if (numOperands > 1) {
+        named = arenaAlloc(&lineArena, JOBS_CAPACITY / 8 + 1);
+        memset(named, 0, JOBS_CAPACITY / 8 + 1);
+    }
+    set->jobs = arenaAlloc(&lineArena, (activeJobs > 0 ? activeJobs : 1) * sizeof(job *));
+    set->numJobs = 0;
+    set->pids = arenaAlloc(&lineArena, numOperands * sizeof(pid_t));
+    set->numPids = 0;
+
+    for (i = 0; i < numOperands; i++) {
+        char *operand = operands[i];
+        char *end;
+        long first, last;
+        int id;
+
+        if ((accept & TARGETS_STATES) && strcmp(operand, "--all") == 0) {
+            states |= 1 << RUNNING | 1 << STOPPED;
+            continue;
+        }
+        if ((accept & TARGETS_STATES) && strcmp(operand, "--running") == 0) {
+            states |= 1 << RUNNING;
+            continue;
+        }
+        if ((accept & TARGETS_STATES) && strcmp(operand, "--stopped") == 0) {
+            states |= 1 << STOPPED;
+            continue;
+        }
+
+        if (operand[0] != '%') {
+            long pid;
+
+            errno = 0;
+            pid = strtol(operand, &end, 10);
+            if (!(accept & TARGETS_PIDS) || !isdigit(operand[0]) || *end != '\0' || errno != 0
+                    || pid <= 0 || pid > INT_MAX) {
+                printf("%s: invalid job id: %s\n", name, operand);
+                return -1;
+            }
+            set->pids[set->numPids++] = pid;
+            continue;
+        }
+
+        /* %n or a range, %a-%b (or %a-b) */
+        errno = 0;
+        first = isdigit(operand[1]) ? strtol(operand + 1, &end, 10) : -1;
+        last = first;
+        if (first >= 0 && *end == '-') {
+            char *start = end[1] == '%' ? end + 2 : end + 1;
+
+            last = isdigit(*start) ? strtol(start, &end, 10) : -1;
+        }
+        if (first < 0 || last < first || last > JOBS_CAPACITY || *end != '\0' || errno != 0) {
+            printf("%s: invalid job id: %s\n", name, operand);
+            return -1;
+        }
+
+        if (first == last && findJob(first) == NULL) {
+            printf("%s: job not found: %s\n", name, operand);
+            return -1;
+        }
+
+        /* a slice of the job table, however many jobs there are */
+        for (id = first > 0 ? first : 1; id <= last; id++) {
+            if ((current = jobTable[id]) != NULL && (named == NULL || !(named[id / 8] & 1 << id % 8))) {
+                if (named != NULL) {
+                    named[id / 8] |= 1 << id % 8;
+                }
+                set->jobs[set->numJobs++] = current;
+            }
+        }
+    }
+
+    /* the state selectors take one walk of the list, in creation order */
+    if (states != 0) {
+        for (current = jobListHead; current != NULL; current = current->next) {
+            if ((states & 1 << current->state) && (named == NULL || !(named[current->id / 8] & 1 << current->id % 8))) {
+                if (named != NULL) {
+                    named[current->id / 8] |= 1 << current->id % 8;
+                }
+                set->jobs[set->numJobs++] = current;
+            }
+        }
+    }
+
+    if (set->numJobs == 0 && set->numPids == 0) {
+        printf("%s: no such jobs\n", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+int parseSignal(char *string) {
+    static const struct {
+        char *name;
+        int number;
+    } signals[] = {
+        { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "ILL", SIGILL },
+        { "TRAP", SIGTRAP }, { "ABRT", SIGABRT }, { "BUS", SIGBUS }, { "FPE", SIGFPE },
+        { "KILL", SIGKILL }, { "USR1", SIGUSR1 }, { "SEGV", SIGSEGV }, { "USR2", SIGUSR2 },
+        { "PIPE", SIGPIPE }, { "ALRM", SIGALRM }, { "TERM", SIGTERM }, { "CHLD", SIGCHLD },
+        { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP }, { "TTIN", SIGTTIN },
+        { "TTOU", SIGTTOU }, { "URG", SIGURG }, { "XCPU", SIGXCPU }, { "XFSZ", SIGXFSZ },
+        { "VTALRM", SIGVTALRM }, { "PROF", SIGPROF }, { "WINCH", SIGWINCH }, { "IO", SIGIO },
+        { "SYS", SIGSYS }
+    };
+    char *end;
+    long number;
+    size_t i;
+
+    if (isdigit(string[0])) {
+        number = strtol(string, &end, 10);
+        return *end == '\0' && number < NSIG ? number : -1;
+    }
+
+    if (strncasecmp(string, "SIG", 3) == 0) {
+        string += 3;
+    }
+
+    for (i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+        if (strcasecmp(string, signals[i].name) == 0) {
+            return signals[i].number;
+        }
+    }
+
+    return -1;
+}
+
+int stringToJobId(char *string) {
+    int i;
+    int result = 0;
+
+    /* make sure job id starts with % */
+    if (string[0] != '%' || string[1] == '\0') {
+        return -1;
+    }
+
+    for (i = 1; string[i]; i++) {
+        if (!isdigit(string[i])) {
+            return -1;
+        }
+
+        /* stops before it could overflow */
+        result *= 10;
+        result += string[i] - '0';
+        if (result > JOBS_CAPACITY) {
+            return -1;
+        }
+    }
+
+    return result;
+}
+
+char *joinString(int argc, char **argv) {
+    char *result = NULL;
+    size_t resultSize = argc > 0 ? argc : 1; /* separators and null terminator */
+    size_t used = 0;
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        resultSize += strlen(argv[i]); /* length of each argument */
+    }
+
+    result = malloc(resultSize * sizeof(char));
+
+    /* copy at a running offset, strcat would rescan the result every time */
+    for (i = 0; i < argc; i++) {
+        size_t length = strlen(argv[i]);
+
+        if (i > 0) {
+            result[used++] = ' ';
+        }
+        memcpy(result + used, argv[i], length);
+        used += length;
+    }
+    result[used] = '\0';
+
+    return result;
+}
+
+int fileExists(char *filename) {
+    struct stat sb;
+
+    if (stat(filename, &sb) != 0) {
+        return 0;
+    }
+
+    if (S_ISDIR(sb.st_mode)) {
+        return 0;
+    }
+
+    return (sb.st_mode & S_IXUSR) > 0;
+}
+
+hashEntry *resolveCommand(char *name) {
+    unsigned int bucket;
+    hashEntry *entry;
+    char candidate[PATH_MAX];
+    int i;
+
+    updatePathDirs();
+
+    bucket = hashString(name) % HASH_BUCKETS;
+    for (entry = commandHash[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            break;
+        }
+    }
+
+    if (entry != NULL) {
+        /* a change in a directory searched before it could shadow it, one in
+         * its own only means the file itself could have been replaced */
+        for (i = 0; entry != NULL && i <= entry->dir; i++) {
+            if (pathDirChanged(i)) {
+                invalidateCommandHash(i);
+                if (i < entry->dir) {
+                    entry = NULL;
+                }
+            }
+        }
+
+        if (entry != NULL && entry->recheck && checkHashEntry(entry) < 0) {
+            retireHashEntry(entry);
+            entry = NULL;
+        }
+
+        if (entry != NULL) {
+            TRACE(TRACE_LOOKUP_HIT, 0, entry->dir);
+            return entry;
+        }
+    }
+
+    /* miss, search every directory in order */
+    for (i = 0; i < numPathDirs; i++) {
+        if (pathDirChanged(i)) {
+            invalidateCommandHash(i);
+        }
+
+        /* a listing completion made up to date says whether to look at all */
+        if (pathDirs[i].listed && pathDirs[i].listedMtime.tv_sec == pathDirs[i].mtime.tv_sec
+                && pathDirs[i].listedMtime.tv_nsec == pathDirs[i].mtime.tv_nsec) {
+            nameList *list = &pathDirs[i].executables;
+            int found = findPrefix(list, name, strlen(name));
+
+            if (found == list->numNames || strcmp(list->names[found], name) != 0) {
+                continue;
+            }
+        }
+
+        if (snprintf(candidate, sizeof(candidate), "%s/%s", pathDirs[i].path, name) >= sizeof(candidate)) {
+            continue;
+        }
+
+        entry = malloc(sizeof(hashEntry));
+        if (openExecutable(candidate, entry) == 0) {
+            entry->name = strdup(name);
+            entry->path = internString(candidate);
+            entry->dir = i;
+            entry->hits = 0;
+            entry->recheck = 0;
+            entry->next = commandHash[bucket];
+            commandHash[bucket] = entry;
+            TRACE(TRACE_LOOKUP_MISS, 0, i);
+            return entry;
+        }
+        free(entry);
+    }
+
+    TRACE(TRACE_LOOKUP_MISS, 0, -1);
+    return NULL;
+}
+
+void updatePathDirs() {
+    char *path = variableValue("PATH");
+    char *start, *end;
+    int i;
+
+    if (path == NULL) {
+        path = DEFAULT_PATH;
+    }
+
+    if (hashedPath != NULL && strcmp(path, hashedPath) == 0) {
+        return;
+    }
+
+    clearCommandHash();
+
+    for (i = 0; i < numPathDirs; i++) {
+        free(pathDirs[i].path);
+        freeNames(&pathDirs[i].executables);
+    }
+    free(pathDirs);
+    free(hashedPath);
+
+    hashedPath = strdup(path);
+
+    numPathDirs = 1;
+    for (start = hashedPath; *start; start++) {
+        if (*start == ':') {
+            numPathDirs++;
+        }
+    }
+
+    pathDirs = calloc(numPathDirs, sizeof(pathDir));
+    relativePathDirs = 0;
+
+    start = hashedPath;
+    for (i = 0; i < numPathDirs; i++) {
+        int length;
+
+        end = strchr(start, ':');
+        length = end != NULL ? end - start : strlen(start);
+
+        /* an empty component means the current directory */
+        pathDirs[i].path = length == 0 ? strdup(".") : strndup(start, length);
+        if (pathDirs[i].path[0] != '/') {
+            relativePathDirs = 1;
+        }
+
+        start = end + 1;
+    }
+}
+
+int pathDirChanged(int dir) {
+    pathDir *d = &pathDirs[dir];
+    struct timespec now;
+    struct stat sb;
+    int changed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (d->checked && (now.tv_sec - d->lastCheck.tv_sec) * 1000000000L
+            + (now.tv_nsec - d->lastCheck.tv_nsec) < HASH_RECHECK_INTERVAL) {
+        return 0;
+    }
+
+    if (stat(d->path, &sb) != 0) {
+        /* missing directories are recorded with a zero mtime */
+        memset(&sb.st_mtim, 0, sizeof(sb.st_mtim));
+    }
+
+    changed = d->checked && (sb.st_mtim.tv_sec != d->mtime.tv_sec
+            || sb.st_mtim.tv_nsec != d->mtime.tv_nsec);
+
+    d->checked = 1;
+    d->mtime = sb.st_mtim;
+    d->lastCheck = now;
+
+    return changed;
+}
+
+void invalidateCommandHash(int fromDir) {
+    int i;
+
+    for (i = 0; i < HASH_BUCKETS; i++) {
+        hashEntry **link = &commandHash[i];
+
+        while (*link != NULL) {
+            hashEntry *entry = *link;
+
+            if (entry->dir > fromDir) {
+                *link = entry->next;
+                entry->next = retiredEntries;
+                retiredEntries = entry;
+            } else {
+                if (entry->dir == fromDir) {
+                    entry->recheck = 1;
+                }
+                link = &entry->next;
+            }
+        }
+    }
+}
+
+void clearCommandHash() {
+    int i;
+
+    for (i = 0; i < HASH_BUCKETS; i++) {
+        while (commandHash[i] != NULL) {
+            retireHashEntry(commandHash[i]);
+        }
+    }
+}
+
+int openExecutable(char *path, hashEntry *entry) {
+    struct stat sb;
+    int fd = -1;
+
+#ifdef EXEC_BY_FD
+    char magic[2];
+
+    /* readable to tell scripts apart, O_PATH will do for execute-only files
+     * (which can't be scripts anyway). Non-blocking in case it is a fifo */
+    if (hashFds < HASH_MAX_FDS) {
+        fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        entry->script = fd >= 0 && pread(fd, magic, 2, 0) == 2 && magic[0] == '#' && magic[1] == '!';
+        if (fd < 0 && errno == EACCES) {
+            fd = open(path, O_PATH | O_CLOEXEC);
+        }
+    }
+#endif
+
+    if (fd >= 0 ? fstat(fd, &sb) != 0 : stat(path, &sb) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    if (!S_ISREG(sb.st_mode) || !(sb.st_mode & S_IXUSR)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    if (fd >= 0) {
+        hashFds++;
+    } else {
+        entry->script = 0;
+    }
+    entry->fd = fd;
+    entry->dev = sb.st_dev;
+    entry->ino = sb.st_ino;
+    entry->mtime = sb.st_mtim;
+
+    return 0;
+}
+
+int checkHashEntry(hashEntry *entry) {
+    struct stat sb;
+
+    entry->recheck = 0;
+
+    if (stat(entry->path, &sb) != 0) {
+        return -1;
+    }
+
+    if (sb.st_dev == entry->dev && sb.st_ino == entry->ino
+            && sb.st_mtim.tv_sec == entry->mtime.tv_sec && sb.st_mtim.tv_nsec == entry->mtime.tv_nsec) {
+        return 0;
+    }
+
+    /* replaced (a new binary renamed over it, say), only this one file is
+     * looked at again. The old fd may still be used by the line running */
+    if (entry->fd >= 0) {
+        hashEntry *old = malloc(sizeof(hashEntry));
+
+        old->name = NULL;
+        old->path = NULL;
+        old->fd = entry->fd;
+        old->next = retiredEntries;
+        retiredEntries = old;
+        entry->fd = -1;
+    }
+
+    return openExecutable(entry->path, entry);
+}
+
+void retireHashEntry(hashEntry *entry) {
+    hashEntry **link = &commandHash[hashString(entry->name) % HASH_BUCKETS];
+
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+
+    entry->next = retiredEntries;
+    retiredEntries = entry;
+}
+
+void freeRetiredEntries() {
+    while (retiredEntries != NULL) {
+        hashEntry *entry = retiredEntries;
+
+        retiredEntries = entry->next;
+        if (entry->fd >= 0) {
+            close(entry->fd);
+            hashFds--;
+        }
+        free(entry->name);
+        if (entry->path != NULL) {
+            releaseString(entry->path);
+        }
+        free(entry);
+    }
+}
+
+nameList *pathExecutables(int dir) {
+    pathDir *d = &pathDirs[dir];
+
+    if (pathDirChanged(dir)) {
+        invalidateCommandHash(dir);
+    }
+
+    if (!d->listed || d->listedMtime.tv_sec != d->mtime.tv_sec || d->listedMtime.tv_nsec != d->mtime.tv_nsec) {
+        freeNames(&d->executables);
+        listDirectory(d->path, 1, &d->executables);
+        d->listed = 1;
+        d->listedMtime = d->mtime;
+    }
+
+    return &d->executables;
+}
+
+int compareNames(const void *a, const void *b) {
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+int listDirectory(char *path, int executablesOnly, nameList *list) {
+    char buffer[DIRENT_BUFFER_SIZE];
+    DIR *dir = NULL;
+    size_t *offsets;
+    size_t used = 0, capacity = 4096;
+    int offsetCapacity = 256;
+    ssize_t bytesRead;
+    int fd;
+    int i;
+
+    list->names = NULL;
+    list->numNames = 0;
+    list->data = NULL;
+
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+#ifndef __linux__
+    if ((dir = fdopendir(fd)) == NULL) {
+        close(fd);
+        return -1;
+    }
+#endif
+
+    /* names are appended to data as offsets, since data moves as it grows */
+    list->data = malloc(capacity);
+    offsets = malloc(offsetCapacity * sizeof(size_t));
+
+    while ((bytesRead = readEntries(dir, fd, buffer, sizeof(buffer))) > 0) {
+        ssize_t position;
+
+        for (position = 0; position < bytesRead; ) {
+            struct dirent64 *entry = (struct dirent64 *) (buffer + position);
+            char *name = entry->d_name;
+            size_t length = strlen(name);
+            int directory = entry->d_type == DT_DIR;
+            struct stat sb;
+
+            position += entry->d_reclen;
+
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+
+            /* the type is only known without a stat for plain entries */
+            if (executablesOnly) {
+                if (directory || fstatat(fd, name, &sb, 0) != 0 || S_ISDIR(sb.st_mode) || !(sb.st_mode & S_IXUSR)) {
+                    continue;
+                }
+            } else if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+                directory = fstatat(fd, name, &sb, 0) == 0 && S_ISDIR(sb.st_mode);
+            }
+
+            if (used + length + 2 > capacity) {
+                capacity = capacity * 2 + length;
+                list->data = realloc(list->data, capacity);
+            }
+            if (list->numNames == offsetCapacity) {
+                offsetCapacity *= 2;
+                offsets = realloc(offsets, offsetCapacity * sizeof(size_t));
+            }
+
+            offsets[list->numNames++] = used;
+            memcpy(list->data + used, name, length);
+            used += length;
+            if (directory) {
+                list->data[used++] = '/';
+            }
+            list->data[used++] = '\0';
+        }
+    }
+
+    if (dir != NULL) {
+        closedir(dir);
+    } else {
+        close(fd);
+    }
+
+    list->names = malloc((list->numNames > 0 ? list->numNames : 1) * sizeof(char *));
+    for (i = 0; i < list->numNames; i++) {
+        list->names[i] = list->data + offsets[i];
+    }
+    free(offsets);
+
+    qsort(list->names, list->numNames, sizeof(char *), compareNames);
+    return 0;
+}
+
+ssize_t readEntries(DIR *dir, int fd, char *buffer, size_t size) {
+#ifdef __linux__
+    return getdents64(fd, buffer, size);
+#else
+    struct dirent *entry = readdir(dir);
+
+    if (entry == NULL) {
+        return 0;
+    }
+    memcpy(buffer, entry, entry->d_reclen);
+    return entry->d_reclen;
+#endif
+}
+
+void freeNames(nameList *list) {
+    free(list->names);
+    free(list->data);
+    list->names = NULL;
+    list->numNames = 0;
+    list->data = NULL;
+}
+
+int findPrefix(nameList *list, char *prefix, size_t length) {
+    int low = 0, high = list->numNames;
+
+    while (low < high) {
+        int middle = (low + high) / 2;
+
+        if (strncmp(list->names[middle], prefix, length) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+int addCandidates(nameList *list, char *prefix, size_t length, char ***candidates, int numCandidates, int *capacity) {
+    int i;
+
+    for (i = findPrefix(list, prefix, length); i < list->numNames; i++) {
+        char *name = list->names[i];
+
+        if (strncmp(name, prefix, length) != 0) {
+            break;
+        }
+        if (name[0] == '.' && length == 0) {
+            continue;
+        }
+
+        if (numCandidates == *capacity) {
+            *capacity = *capacity == 0 ? 64 : *capacity * 2;
+            *candidates = realloc(*candidates, *capacity * sizeof(char *));
+        }
+        (*candidates)[numCandidates++] = name;
+    }
+
+    return numCandidates;
+}
+
+void completeWord(lineEditor *e) {
+    size_t start = e->cursor, before;
+    char *word, *prefix;
+    size_t wordLength, prefixLength, common;
+    char **candidates = NULL;
+    int numCandidates = 0, capacity = 0;
+    nameList files = { NULL, 0, NULL };
+    int i, unique;
+
+    while (start > 0 && e->buffer[start - 1] != ' ' && e->buffer[start - 1] != '|') {
+        start--;
+    }
+    word = e->buffer + start;
+    wordLength = e->cursor - start;
+
+    before = start;
+    while (before > 0 && e->buffer[before - 1] == ' ') {
+        before--;
+    }
+
+    if ((before == 0 || e->buffer[before - 1] == '|') && memchr(word, '/', wordLength) == NULL) {
+        /* a command, one of the builtins (in alphabetical order) or one of
+         * the executables on $PATH */
+        char *names[sizeof(builtins) / sizeof(builtins[0])];
+        nameList builtinNames = { names, sizeof(builtins) / sizeof(builtins[0]), NULL };
+
+        for (i = 0; i < builtinNames.numNames; i++) {
+            names[i] = builtins[i].name;
+        }
+
+        prefix = word;
+        prefixLength = wordLength;
+        numCandidates = addCandidates(&builtinNames, prefix, prefixLength, &candidates, numCandidates, &capacity);
+
+        updatePathDirs();
+        for (i = 0; i < numPathDirs; i++) {
+            numCandidates = addCandidates(pathExecutables(i), prefix, prefixLength, &candidates, numCandidates, &capacity);
+        }
+    } else {
+        /* a file in the directory the word names */
+        char *slash = memrchr(word, '/', wordLength);
+        char directory[PATH_MAX];
 
-    while ((pid = waitpid(-1, &status, WUNTRACED | WNOHANG)) > 0) {
-        sigprocmask(SIG_BLOCK, &maskAll, &prevAll);
-        if (WIFEXITED(status)) {
-            markJob(pid, COMPLETED, -1);
+        prefix = slash != NULL ? slash + 1 : word;
+        prefixLength = word + wordLength - prefix;
+
+        if (slash == NULL) {
+            strcpy(directory, ".");
+        } else {
+            snprintf(directory, sizeof(directory), "%.*s", slash == word ? 1 : (int) (slash - word), word);
         }
 
-        if (WIFSTOPPED(status)) {
-            markJob(pid, STOPPED, -1);
+        listDirectory(directory, 0, &files);
+        numCandidates = addCandidates(&files, prefix, prefixLength, &candidates, numCandidates, &capacity);
+    }
+
+    if (numCandidates == 0) {
+        printf("\a");
+        free(candidates);
+        freeNames(&files);
+        return;
+    }
+
+    /* the same name can be in several directories */
+    qsort(candidates, numCandidates, sizeof(char *), compareNames);
+    for (i = 1, unique = 1; i < numCandidates; i++) {
+        if (strcmp(candidates[i], candidates[unique - 1]) != 0) {
+            candidates[unique++] = candidates[i];
         }
+    }
+    numCandidates = unique;
+
+    /* sorted, so the first and last share the least */
+    common = 0;
+    while (candidates[0][common] != '\0' && candidates[0][common] == candidates[numCandidates - 1][common]) {
+        common++;
+    }
 
-        if (WIFSIGNALED(status)) {
-            markJob(pid, TERMINATED, WTERMSIG(status));
+    if (common > prefixLength) {
+        size_t j;
+
+        for (j = prefixLength; j < common; j++) {
+            insertKey(e, candidates[0][j]);
         }
-        sigprocmask(SIG_SETMASK, &prevAll, NULL);
+    } else if (numCandidates > 1) {
+        listCandidates(candidates, numCandidates);
     }
-    errno = oldErrno;
-}
 
-/* empty so that shell doesn't exit */
-void sigintHandler(int signum) {
-}
-void sigtstpHandler(int signum) {
+    if (numCandidates == 1 && candidates[0][common - 1] != '/') {
+        insertKey(e, ' ');
+    }
+
+    free(candidates);
+    freeNames(&files);
 }
 
-char **tokenize(char *input, int *numTokens, int *capacity) {
-    int maxSize = COMMAND_LENGTH;
-    char **result = malloc(maxSize * sizeof(char*));
-    int currentSize = 0;
-    char *token = strtok(input, " \t\r\n");
-    
-    while (token) {
-        if (currentSize == maxSize) {
-            maxSize += COMMAND_LENGTH;
-            result = realloc(result, maxSize * sizeof(char*));
-        }
+void listCandidates(char **candidates, int numCandidates) {
+    struct winsize size;
+    int columns = 80, width = 0;
+    int shown = numCandidates < COMPLETION_LIST_MAX ? numCandidates : COMPLETION_LIST_MAX;
+    int perRow;
+    int i;
 
-        result[currentSize] = strdup(token);
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) {
+        columns = size.ws_col;
+    }
+
+    for (i = 0; i < shown; i++) {
+        int length = strlen(candidates[i]) + 2;
 
-        token = strtok(NULL, " ");
-        currentSize++;
+        if (length > width) {
+            width = length;
+        }
     }
+    perRow = columns / width > 0 ? columns / width : 1;
 
-    *numTokens = currentSize;
-    *capacity = maxSize;
-    return result;
-}
+    printf("\n");
+    for (i = 0; i < shown; i++) {
+        int endOfRow = (i + 1) % perRow == 0 || i + 1 == shown;
 
-int handleAmpersand(char **tokens, int *numTokens) {
-    int lastTokenLength;
+        printf("%-*s%s", endOfRow ? 0 : width, candidates[i], endOfRow ? "\n" : "");
+    }
 
-    /* last token is an ampersand */
-    if (strcmp(tokens[*numTokens - 1], "&") == 0) {
-        free(tokens[*numTokens - 1]);
-        (*numTokens)--;
-        return 1;
+    if (shown < numCandidates) {
+        printf("(%d more)\n", numCandidates - shown);
     }
+}
 
-    lastTokenLength = strlen(tokens[*numTokens - 1]);
+unsigned int hashString(char *string) {
+    /* FNV-1a */
+    unsigned int result = 2166136261u;
 
-    /* last character of last token is an ampersand */
-    if (tokens[*numTokens - 1][lastTokenLength - 1] == '&') {
-        tokens[*numTokens - 1][lastTokenLength - 1] = '\0';
-        return 1;
+    while (*string) {
+        result ^= (unsigned char) *string++;
+        result *= 16777619u;
     }
 
-    return 0;
+    return result;
 }
 
-void bg(char **argv, int numTokens) {
-    int jid;
-    job *current;
+int hash(char **argv, int numTokens) {
+    hashEntry *entry;
+    int status = 0;
+    int i;
 
-    if (numTokens != 2) {
-        puts("bg: wrong number of arguments");
-        return;
+    if (numTokens == 1) {
+        int empty = 1;
+
+        for (i = 0; i < HASH_BUCKETS; i++) {
+            for (entry = commandHash[i]; entry != NULL; entry = entry->next) {
+                if (empty) {
+                    puts("hits\tcommand");
+                    empty = 0;
+                }
+                printf("%4d\t%s\n", entry->hits, entry->path);
+            }
+        }
+
+        if (empty) {
+            puts("hash: hash table empty");
+        }
+        return 0;
     }
 
-    if ((jid = stringToJobId(argv[1])) == -1) {
-        puts("bg: invalid job id");
-        return;
+    if (strcmp(argv[1], "-r") == 0) {
+        if (numTokens > 2) {
+            puts("hash: too many arguments");
+            return 1;
+        }
+
+        clearCommandHash();
+        return 0;
     }
 
-    current = jobListHead;
-    while (current != NULL && current->id != jid) {
-        current = current->next;
+    if (strcmp(argv[1], "-t") == 0) {
+        if (numTokens == 2) {
+            puts("hash: -t: option requires an argument");
+            return 1;
+        }
+
+        /* print where each command resolves to */
+        for (i = 2; i < numTokens; i++) {
+            if ((entry = resolveCommand(argv[i])) == NULL) {
+                printf("hash: %s: not found\n", argv[i]);
+                status = 1;
+            } else if (numTokens == 3) {
+                puts(entry->path);
+            } else {
+                printf("%s\t%s\n", argv[i], entry->path);
+            }
+        }
+        return status;
     }
 
-    if (current == NULL) {
-        puts("bg: job not found");
-        return;
+    /* remember the location of each command */
+    for (i = 1; i < numTokens; i++) {
+        if (resolveCommand(argv[i]) == NULL) {
+            printf("hash: %s: not found\n", argv[i]);
+            status = 1;
+        }
     }
 
-    if (current->state == RUNNING) {
-        puts("bg: job is already running");
-        return;
+    return status;
+}
+
+char *internString(char *string) {
+    unsigned int hash = hashString(string);
+    internedString **bucket = &internTable[hash % INTERN_BUCKETS];
+    internedString *current;
+    size_t length;
+
+    for (current = *bucket; current != NULL; current = current->next) {
+        if (current->hash == hash && strcmp(current->text, string) == 0) {
+            current->refs++;
+            return current->text;
+        }
     }
 
-    current->bgProcess = 1;
-    current->state = RUNNING;
+    length = strlen(string);
+    current = malloc(sizeof(internedString) + length + 1);
+    memcpy(current->text, string, length + 1);
+    current->hash = hash;
+    current->refs = 1;
+    current->next = *bucket;
+    *bucket = current;
+
+    return current->text;
+}
+
+void releaseString(char *string) {
+    internedString *interned = (internedString *) (string - offsetof(internedString, text));
+    internedString **link;
 
-    if (kill(current->pgid, SIGCONT) < 0) {
-        puts("bg: could not continue process");
+    if (--interned->refs > 0) {
         return;
     }
+
+    link = &internTable[interned->hash % INTERN_BUCKETS];
+    while (*link != interned) {
+        link = &(*link)->next;
+    }
+    *link = interned->next;
+
+    free(interned);
 }
 
-void cd(char **argv, int numTokens) {
-    char *directory;
+void initTrace() {
+    char *value = getenv("SHELL_TRACE");
 
-    if (numTokens > 2) {
-        puts("cd: too many arguments");
+    if (value == NULL || value[0] == '\0' || strcmp(value, "0") == 0) {
         return;
     }
 
-    directory = numTokens == 1 ? getenv("HOME") : argv[1];
-
-    if (directory != NULL) {
-        if (chdir(directory) != 0) {
-            printf("cd: no such file or directory: %s\n", directory);
-            return;
-        }
-        setenv("PWD", directory, 1);
+    if (startTrace() == 0) {
+        traceFile = value;
     }
 }
 
-void exitFunc(int numTokens) {
-    if (numTokens > 1) {
-        puts("exit: too many arguments");
-        return;
+int startTrace() {
+    if (traceBuffer == NULL) {
+        /* pages are only touched as the ring fills */
+        void *buffer = mmap(NULL, TRACE_CAPACITY * sizeof(traceEvent), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (buffer == MAP_FAILED) {
+            printf("trace: %s\n", strerror(errno));
+            return -1;
+        }
+        traceBuffer = buffer;
     }
 
-    cleanUpShell();
+    tracing = 1;
+    return 0;
 }
 
-void fg(char **argv, int numTokens) {
-    int jid;
-    job *current;
-    int status, wpid;
+void traceRecord(int type, pid_t pid, long arg) {
+    unsigned long index = __atomic_fetch_add(&traceHead, 1, __ATOMIC_RELAXED);
+    traceEvent *slot = &traceBuffer[index & (TRACE_CAPACITY - 1)];
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    __atomic_store_n(&slot->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    slot->time = now.tv_sec * 1000000000L + now.tv_nsec;
+    slot->type = type;
+    slot->pid = pid;
+    slot->arg = arg;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    __atomic_store_n(&slot->sequence, index + 1, __ATOMIC_RELAXED);
+}
 
-    if (numTokens != 2) {
-        puts("fg: wrong number of arguments");
-        return;
+int dumpTrace(char *path, int chrome) {
+    /* names, and Chrome's phase: B/E for the two ends of a span, i for instants */
+    static const struct {
+        char *name;
+        char phase;
+    } types[NUM_TRACE_TYPES] = {
+        [TRACE_LINE_READ]    = { "line_read",   'i' },
+        [TRACE_TOKENIZED]    = { "tokenized",   'i' },
+        [TRACE_LOOKUP_HIT]   = { "lookup_hit",  'i' },
+        [TRACE_LOOKUP_MISS]  = { "lookup_miss", 'i' },
+        [TRACE_LAUNCH_BEGIN] = { "launch",      'B' },
+        [TRACE_LAUNCH_END]   = { "launch",      'E' },
+        [TRACE_FORK]         = { "fork",        'i' },
+        [TRACE_SPAWN]        = { "spawn",       'i' },
+        [TRACE_EXEC]         = { "exec",        'i' },
+        [TRACE_TCSETPGRP]    = { "tcsetpgrp",   'i' },
+        [TRACE_SIGCHLD]      = { "sigchld",     'i' },
+        [TRACE_STATE]        = { "state",       'i' },
+        [TRACE_WAIT_BEGIN]   = { "wait",        'B' },
+        [TRACE_WAIT_END]     = { "wait",        'E' },
+        [TRACE_CLEANUP]      = { "cleanup",     'i' }
+    };
+    FILE *out = stdout;
+    unsigned long head = __atomic_load_n(&traceHead, __ATOMIC_RELAXED);
+    unsigned long index = head - traceStart > TRACE_CAPACITY ? head - TRACE_CAPACITY : traceStart;
+    pid_t shellPid = getpid();
+    int first = 1;
+
+    if (traceBuffer == NULL) {
+        index = head;
     }
 
-    if ((jid = stringToJobId(argv[1])) == -1) {
-        puts("fg: invalid job id");
-        return;
+    if (strcmp(path, "-") != 0 && (out = fopen(path, "w")) == NULL) {
+        printf("trace: %s: %s\n", path, strerror(errno));
+        return -1;
     }
 
-    current = jobListHead;
-    while (current != NULL && current->id != jid) {
-        current = current->next;
+    if (chrome) {
+        fputs("{\"traceEvents\":[\n", out);
     }
 
-    if (current == NULL) {
-        puts("fg: job not found");
-        return;
+    for (; index < head; index++) {
+        traceEvent *slot = &traceBuffer[index & (TRACE_CAPACITY - 1)];
+        unsigned long sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+        traceEvent event;
+
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        event = *slot;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+        /* skip slots being written, or overwritten since head was read */
+        if (sequence != index + 1 || __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence
+                || event.type < 0 || event.type >= NUM_TRACE_TYPES) {
+            continue;
+        }
+
+        if (chrome) {
+            fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"%c\",%s\"ts\":%ld.%03ld,\"pid\":%d,\"tid\":%d,"
+                    "\"args\":{\"pid\":%d,\"arg\":%ld}}",
+                    first ? "" : ",\n", types[event.type].name, types[event.type].phase,
+                    types[event.type].phase == 'i' ? "\"s\":\"t\"," : "",
+                    event.time / 1000, event.time % 1000, shellPid, shellPid, event.pid, event.arg);
+        } else {
+            fprintf(out, "{\"seq\":%lu,\"ts_ns\":%ld,\"event\":\"%s\",\"phase\":\"%c\",\"pid\":%d,\"arg\":%ld}\n",
+                    index - traceStart, event.time, types[event.type].name, types[event.type].phase,
+                    event.pid, event.arg);
+        }
+        first = 0;
     }
 
-    current->bgProcess = 0;
+    if (chrome) {
+        fputs("\n]}\n", out);
+    }
 
-    if (current->state == STOPPED) {
-        if (kill(current->pgid, SIGCONT) < 0) {
-            puts("fg: could not continue process");
-            return;
+    if (out != stdout && fclose(out) != 0) {
+        printf("trace: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int chromeTracePath(char *path) {
+    size_t length = strlen(path);
+
+    return length >= 5 && strcmp(path + length - 5, ".json") == 0;
+}
+
+void initVariables() {
+    char **inherited = environ;
+    int count;
+    int i;
+
+    for (count = 0; inherited[count] != NULL; count++);
+
+    exportedCapacity = count + 16;
+    exportedEnv = malloc(exportedCapacity * sizeof(char *));
+    exportedVars = malloc(exportedCapacity * sizeof(variable *));
+    exportedEnv[0] = NULL;
+
+    for (i = 0; i < count; i++) {
+        char *entry = inherited[i];
+        size_t nameLength = strcspn(entry, "=");
+
+        if (entry[nameLength] == '=') {
+            setVariable(entry, nameLength, entry + nameLength + 1, 1);
         }
-        current->state = RUNNING;
     }
 
-    signal(SIGTTOU, SIG_IGN);
-    tcsetpgrp(STDIN_FILENO, getpgid(current->pgid));
-    wpid = waitpid(current->pgid, &status, WUNTRACED);
-    tcsetpgrp(STDIN_FILENO, getpgid(getpid()));
+    environ = exportedEnv;
+}
 
-    if (wpid < 0) {
-        puts(strerror(errno));
-        return;
+variable *findVariable(char *name, size_t length) {
+    variable *v;
+
+    for (v = variables[hashName(name, length) & (VAR_BUCKETS - 1)]; v != NULL; v = v->next) {
+        if (v->nameLength == length && memcmp(v->entry, name, length) == 0) {
+            return v;
+        }
     }
 
-    if (WIFEXITED(status)) {
-        /* exited normally */
-        current->state = COMPLETED;
+    return NULL;
+}
+
+char *variableValue(char *name) {
+    size_t length = strlen(name);
+    variable *v = findVariable(name, length);
+
+    return v != NULL ? v->entry + length + 1 : NULL;
+}
+
+void setVariable(char *name, size_t nameLength, char *value, int export) {
+    variable *v = findVariable(name, nameLength);
+    size_t valueLength = strlen(value);
+    char *entry = malloc(nameLength + valueLength + 2);
+
+    /* value may be part of the old entry, which goes only afterwards */
+    memcpy(entry, name, nameLength);
+    entry[nameLength] = '=';
+    memcpy(entry + nameLength + 1, value, valueLength + 1);
+
+    if (v == NULL) {
+        unsigned int bucket = hashName(name, nameLength) & (VAR_BUCKETS - 1);
+
+        v = malloc(sizeof(variable));
+        v->nameLength = nameLength;
+        v->envIndex = -1;
+        v->changed = 0;
+        v->next = variables[bucket];
+        variables[bucket] = v;
+    } else {
+        free(v->entry);
     }
+    v->entry = entry;
 
-    if (WIFSTOPPED(status)) {
-        current->state = STOPPED;
+    if (v->envIndex >= 0) {
+        exportedEnv[v->envIndex] = entry;
+        environEntryChanged(v);
+    } else if (export) {
+        exportVariable(v, 1);
     }
+}
 
-    if (WIFSIGNALED(status)) {
-        current->state = TERMINATED;
-        current->termSig = WTERMSIG(status);
+void exportVariable(variable *v, int export) {
+    if (export && v->envIndex < 0) {
+        if (numExported + 1 >= exportedCapacity) {
+            exportedCapacity *= 2;
+            exportedEnv = realloc(exportedEnv, exportedCapacity * sizeof(char *));
+            exportedVars = realloc(exportedVars, exportedCapacity * sizeof(variable *));
+            environ = exportedEnv;
+        }
+
+        v->envIndex = numExported;
+        exportedEnv[numExported] = v->entry;
+        exportedVars[numExported++] = v;
+        exportedEnv[numExported] = NULL;
+        environEntryChanged(v);
+    } else if (!export && v->envIndex >= 0) {
+        /* the last entry takes its place, order doesn't matter */
+        numExported--;
+        exportedEnv[v->envIndex] = exportedEnv[numExported];
+        exportedVars[v->envIndex] = exportedVars[numExported];
+        exportedVars[v->envIndex]->envIndex = v->envIndex;
+        exportedEnv[numExported] = NULL;
+        v->envIndex = -1;
+        environEntryChanged(v);
     }
 }
 
+void environEntryChanged(variable *v) {
+    environGeneration++;
 
-void jobs(int numTokens) {
-    if (numTokens > 1) {
-        puts("jobs: too many arguments");
+#ifdef ZYGOTE_LAUNCHER
+    if (zygoteFd < 0 || v->changed) {
         return;
     }
 
-    printJobs();
+    if (numChangedNames == changedCapacity) {
+        changedCapacity = changedCapacity == 0 ? 16 : changedCapacity * 2;
+        changedNames = realloc(changedNames, changedCapacity * sizeof(char *));
+    }
+
+    /* a copy, the variable may be unset before the next launch */
+    changedNames[numChangedNames] = malloc(v->nameLength + 1);
+    memcpy(changedNames[numChangedNames], v->entry, v->nameLength);
+    changedNames[numChangedNames++][v->nameLength] = '\0';
+    v->changed = 1;
+#endif
 }
 
-void killFunc(char **argv, int numTokens) {
-    int jid;
-    job *current;
+void unsetVariable(char *name, size_t nameLength) {
+    variable **link = &variables[hashName(name, nameLength) & (VAR_BUCKETS - 1)];
 
-    if (numTokens != 2) {
-        puts("kill: wrong number of arguments");
-        return;
+    while (*link != NULL) {
+        variable *v = *link;
+
+        if (v->nameLength == nameLength && memcmp(v->entry, name, nameLength) == 0) {
+            exportVariable(v, 0);
+            *link = v->next;
+            free(v->entry);
+            free(v);
+            return;
+        }
+        link = &v->next;
     }
+}
 
-    if ((jid = stringToJobId(argv[1])) == -1) {
-        puts("kill: invalid job id");
-        return;
+savedVariable *exportAssignments(arena *a, char **assignments, int count) {
+    savedVariable *saved = arenaAlloc(a, count * sizeof(savedVariable));
+    int i;
+
+    for (i = 0; i < count; i++) {
+        size_t nameLength = assignmentName(assignments[i]);
+        variable *v = findVariable(assignments[i], nameLength);
+
+        saved[i].entry = v != NULL ? arenaCopy(a, v->entry, strlen(v->entry)) : NULL;
+        saved[i].exported = v != NULL && v->envIndex >= 0;
+        setVariable(assignments[i], nameLength, assignments[i] + nameLength + 1, 1);
     }
 
-    current = jobListHead;
-    while (current != NULL && current->id != jid) {
-        current = current->next;
+    return saved;
+}
+
+void restoreVariables(char **assignments, savedVariable *saved, int count) {
+    int i;
+
+    /* backwards, so a name assigned twice gets its first value back */
+    for (i = count - 1; i >= 0; i--) {
+        size_t nameLength = assignmentName(assignments[i]);
+
+        if (saved[i].entry == NULL) {
+            unsetVariable(assignments[i], nameLength);
+        } else {
+            setVariable(saved[i].entry, nameLength, saved[i].entry + nameLength + 1, 0);
+            exportVariable(findVariable(saved[i].entry, nameLength), saved[i].exported);
+        }
     }
+}
 
-    if (current == NULL) {
-        puts("kill: job not found");
-        return;
+size_t variableNameLength(char *name) {
+    size_t length = 0;
+
+    if (!isalpha((unsigned char) name[0]) && name[0] != '_') {
+        return 0;
     }
 
-    if (kill(current->pgid, SIGTERM) < 0) {
-        puts("kill: could not terminate job");
-        return;
+    while (isalnum((unsigned char) name[length]) || name[length] == '_') {
+        length++;
     }
-}
 
-int runCommand(char *command, int argc, char **argv, int bgProcess) {
-    pid_t pid;
+    return length;
+}
 
-    sigset_t maskAll, maskOne, prevOne;
+size_t assignmentName(char *word) {
+    size_t length = variableNameLength(word);
 
-    sigfillset(&maskAll);
-    sigemptyset(&maskOne);
-    sigaddset(&maskOne, SIGCHLD);
+    return length > 0 && word[length] == '=' ? length : 0;
+}
 
-    sigprocmask(SIG_BLOCK, &maskOne, &prevOne);
+char **overrideEnvironment(arena *a, char **assignments, int count) {
+    char **env = arenaAlloc(a, (numExported + count + 1) * sizeof(char *));
+    int numEntries = numExported;
+    int i;
 
-    pid = fork();
+    /* the shared entries as they are, then the few that differ */
+    memcpy(env, exportedEnv, numExported * sizeof(char *));
 
-    /* child process */
-    if (pid == 0) {
-        sigprocmask(SIG_SETMASK, &prevOne, NULL);
-        setpgid(0, 0);
+    for (i = 0; i < count; i++) {
+        size_t nameLength = assignmentName(assignments[i]);
+        variable *v = findVariable(assignments[i], nameLength);
+        int slot;
 
-        if (execv(command, argv) != 0) {
-            if (argv[0][0] == '.' || argv[0][0] == '/') {
-                printf("%s: No such file or directory\n", command);
+        if (v != NULL && v->envIndex >= 0) {
+            slot = v->envIndex;
+        } else {
+            /* a new name, unless an earlier assignment added it already */
+            for (slot = numExported; slot < numEntries; slot++) {
+                if (strncmp(env[slot], assignments[i], nameLength + 1) == 0) {
+                    break;
+                }
+            }
+            if (slot == numEntries) {
+                numEntries++;
             }
-            exit(errno);
         }
-    } else if (pid > 0) {
-        int status;
-        char *originalCommand;
-        sigprocmask(SIG_BLOCK, &maskAll, NULL);
+        env[slot] = assignments[i];
+    }
+    env[numEntries] = NULL;
 
-        setpgid(pid, pid);
+    return env;
+}
 
-        originalCommand = joinString(argc, argv);
+int expandVariables(arena *a, char **tokens, int numTokens) {
+    int kept = 0;
+    int i;
 
-        if (bgProcess) {
-            /* create and add job to job list */
-            job *j = createJob(strdup(command), originalCommand, pid, RUNNING, 1);
-            addJob(j);
+    for (i = 0; i < numTokens; i++) {
+        char *token = tokens[i];
 
-            printf("[%d] %d\n", j->id, pid);
+        if (strchr(token, '$') != NULL) {
+            size_t length = expandWord(token, NULL);
 
-            sigprocmask(SIG_SETMASK, &prevOne, NULL);
-        } else {
-            job *j;
-            pid_t wpid;
+            /* like a variable that is unset, a word that is only that is gone */
+            if (length == 0) {
+                continue;
+            }
+            token = arenaAlloc(a, length + 1);
+            expandWord(tokens[i], token);
+        }
+        tokens[kept++] = token;
+    }
+    tokens[kept] = NULL;
 
-            j = createJob(strdup(command), originalCommand, pid, RUNNING, 0);
-            addJob(j);
+    return kept;
+}
 
-            signal(SIGTTOU, SIG_IGN);
-            tcsetpgrp(STDIN_FILENO, getpgid(pid));
-            wpid = waitpid(pid, &status, WUNTRACED);
-            tcsetpgrp(STDIN_FILENO, getpgid(getpid()));
+size_t expandWord(char *word, char *result) {
+    size_t length = 0;
 
+    while (*word != '\0') {
+        char number[16];
+        char *value;
+        size_t nameLength;
+        size_t valueLength;
 
-            if (wpid < 0) {
-                puts(strerror(errno));
-                return -1;
+        if (*word != '$') {
+            if (result != NULL) {
+                result[length] = *word;
             }
+            length++;
+            word++;
+            continue;
+        }
 
-            if (WIFEXITED(status)) {
-                /* exited normally */
-                j->state = COMPLETED;
-            }
+        if (word[1] == '?' || word[1] == '$') {
+            snprintf(number, sizeof(number), "%d", word[1] == '?' ? lastStatus : (int) getpid());
+            value = number;
+            word += 2;
+        } else if (word[1] == '{' && (nameLength = variableNameLength(word + 2)) > 0 && word[2 + nameLength] == '}') {
+            variable *v = findVariable(word + 2, nameLength);
 
-            if (WIFSTOPPED(status)) {
-                /* user pressed Ctrl-Z */
-                j->state = STOPPED;
-            }
+            value = v != NULL ? v->entry + nameLength + 1 : "";
+            word += nameLength + 3;
+        } else if ((nameLength = variableNameLength(word + 1)) > 0) {
+            variable *v = findVariable(word + 1, nameLength);
 
-            if (WIFSIGNALED(status)) {
-                /* exited with some unhandled signal */
-                j->state = TERMINATED;
-                j->termSig = WTERMSIG(status);
-            }
-            sigprocmask(SIG_SETMASK, &prevOne, NULL);
+            value = v != NULL ? v->entry + nameLength + 1 : "";
+            word += nameLength + 1;
+        } else {
+            /* a $ that doesn't start a name is just that */
+            value = "$";
+            word++;
+        }
 
+        valueLength = strlen(value);
+        if (result != NULL) {
+            memcpy(result + length, value, valueLength);
         }
-        return 0;
+        length += valueLength;
     }
 
-    /* failed to fork */
-    return -1;
+    if (result != NULL) {
+        result[length] = '\0';
+    }
+    return length;
 }
 
-int stringToJobId(char *string) {
-    int i;
-    int result = 0;
+char *searchPath(char *name, char *path) {
+    size_t nameLength = strlen(name);
 
-    /* make sure job id starts with % */
-    if (string[0] != '%') {
-        return -1;
-    }
+    while (1) {
+        size_t length = strcspn(path, ":");
+        char *candidate = arenaAlloc(&lineArena, length + nameLength + 3);
+        struct stat sb;
 
-    for (i = 1; string[i]; i++) {
-        if (!isdigit(string[i])) {
-            return -1;
+        /* an empty component means the current directory */
+        if (length == 0) {
+            candidate[0] = '.';
+            length = 1;
+        } else {
+            memcpy(candidate, path, length);
         }
+        candidate[length] = '/';
+        memcpy(candidate + length + 1, name, nameLength + 1);
 
-        result *= 10;
-        result += string[i] - '0';
+        if (stat(candidate, &sb) == 0 && S_ISREG(sb.st_mode) && access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+
+        path += strcspn(path, ":");
+        if (*path == '\0') {
+            return NULL;
+        }
+        path++;
+    }
+}
+
+unsigned int hashName(char *name, size_t length) {
+    /* FNV-1a, like hashString() */
+    unsigned int result = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        result ^= (unsigned char) name[i];
+        result *= 16777619u;
     }
 
     return result;
 }
 
-char *joinString(int argc, char **argv) {
-    char *result = NULL;
-    int resultSize = 1; /* null terminator */
+int exportFunc(char **argv, int numTokens) {
+    int status = 0;
     int i;
 
-    for (i = 0; i < argc; i++) {
-        resultSize += strlen(argv[i]); /* length of each argument */
+    /* export lists them, sorted */
+    if (numTokens == 1) {
+        char **entries = arenaAlloc(&lineArena, (numExported + 1) * sizeof(char *));
+
+        memcpy(entries, exportedEnv, numExported * sizeof(char *));
+        qsort(entries, numExported, sizeof(char *), compareNames);
+        for (i = 0; i < numExported; i++) {
+            printf("export %s\n", entries[i]);
+        }
+        return 0;
     }
 
-    resultSize += (argc - 1); /* separators */
+    /* export NAME=value or export NAME, -n NAME takes it out again */
+    for (i = 1; i < numTokens; i++) {
+        int unexport = strcmp(argv[i], "-n") == 0 && i + 1 < numTokens;
+        char *operand = unexport ? argv[++i] : argv[i];
+        size_t nameLength = variableNameLength(operand);
+        variable *v;
 
-    result = malloc(resultSize * sizeof(char));
-    result[0] = '\0';
+        if (nameLength == 0 || (operand[nameLength] != '\0' && operand[nameLength] != '=')) {
+            printf("export: not a valid name: %s\n", operand);
+            status = 1;
+            continue;
+        }
 
-    for (i = 0; i < argc; i++) {
-        strcat(result, argv[i]);
-        if (i < (argc - 1)) {
-            strcat(result, " ");
+        if (operand[nameLength] == '=') {
+            setVariable(operand, nameLength, operand + nameLength + 1, !unexport);
+            if (unexport) {
+                exportVariable(findVariable(operand, nameLength), 0);
+            }
+        } else if ((v = findVariable(operand, nameLength)) != NULL) {
+            exportVariable(v, !unexport);
+        } else if (!unexport) {
+            /* an unset name is exported empty */
+            setVariable(operand, nameLength, "", 1);
         }
     }
 
-    return result;
+    return status;
 }
 
-int fileExists(char *filename) {
-    struct stat sb;
+int unsetFunc(char **argv, int numTokens) {
+    int status = 0;
+    int i;
 
-    if (stat(filename, &sb) != 0) {
-        return 0;
-    }
+    for (i = 1; i < numTokens; i++) {
+        size_t nameLength = variableNameLength(argv[i]);
 
-    if (S_ISDIR(sb.st_mode)) {
-        return 0;
+        if (nameLength == 0 || argv[i][nameLength] != '\0') {
+            printf("unset: not a valid name: %s\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        unsetVariable(argv[i], nameLength);
     }
 
-    return (sb.st_mode & S_IXUSR) > 0;
+    return status;
 }
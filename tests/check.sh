@@ -0,0 +1,248 @@
+#!/bin/sh
+# regression checks, each runs shell -c on a line (or feeds it lines on stdin)
+# and compares its output. They run in a scratch directory holding the files
+# the glob checks match.
+# Usage: tests/check.sh [shell]
+
+SHELL_UNDER_TEST=${1:-./shell}
+failed=0
+
+case $SHELL_UNDER_TEST in
+    /*) ;;
+    *) SHELL_UNDER_TEST=$PWD/$SHELL_UNDER_TEST ;;
+esac
+
+scratch=$(mktemp -d) || exit 1
+trap 'rm -rf "$scratch"' EXIT
+cd "$scratch" || exit 1
+touch '|'
+mkdir cgroup
+mkdir -p glob/dir
+touch glob/a.c glob/b.c glob/.hidden.c glob/dir/x.c
+echo ch > glob/c.h
+
+# report NAME LINE EXPECTED OUTPUT
+report() {
+    if [ "$4" != "$3" ]; then
+        printf 'FAIL %s\n  line:     %s\n  expected: %s\n  got:      %s\n' "$1" "$2" "$3" "$4"
+        failed=1
+    else
+        printf 'ok   %s\n' "$1"
+    fi
+}
+
+# check NAME LINE EXPECTED [NAME=value...], the assignments are for the
+# shell's environment
+check() {
+    name=$1 line=$2 expected=$3
+    shift 3
+    report "$name" "$line" "$expected" "$(env "$@" "$SHELL_UNDER_TEST" -c "$line" 2>&1)"
+}
+
+# checkInput NAME LINES EXPECTED [NAME=value...], for state that must carry
+# across lines
+checkInput() {
+    name=$1 line=$2 expected=$3
+    shift 3
+    report "$name" "$line" "$expected" "$(printf '%s\n' "$line" | env "$@" "$SHELL_UNDER_TEST" 2>&1)"
+}
+
+# checkJobs NAME LINES EXPECTED, like checkInput for lines that report jobs,
+# with their pids masked and sorted since jobs finish in any order
+checkJobs() {
+    report "$1" "$2" "$3" "$(printf '%s\n' "$2" | "$SHELL_UNDER_TEST" 2>&1 | sed 's/^\(\[[0-9]*\]\) [0-9]*/\1 PID/' | sort)"
+}
+
+# pipelines
+check "pipeline" \
+    "echo a b | wc -w" \
+    "2"
+check "pipeline without spaces" \
+    "echo hi|cat|cat" \
+    "hi"
+check "pipeline with an empty stage" \
+    "echo hi | | cat" \
+    "syntax error near unexpected token \`|'"
+check "pipeline ending in a pipe" \
+    "echo hi |" \
+    "syntax error near unexpected token \`newline'"
+check "glob matching a file named |" \
+    "echo ? wc -c" \
+    "| wc -c"
+check "variable holding |" \
+    "echo a \$P wc -c" \
+    "a | wc -c" \
+    "P=|"
+check "variable holding >" \
+    "echo hi \$O out" \
+    "hi > out" \
+    "O=>"
+
+# globs
+check "glob" \
+    "echo glob/*.c" \
+    "glob/a.c glob/b.c"
+check "glob with ? and a bracket" \
+    "echo glob/?.h glob/[!a].c" \
+    "glob/c.h glob/b.c"
+check "glob in a directory component" \
+    "echo glob/*/x.c" \
+    "glob/dir/x.c"
+check "absolute glob" \
+    "echo /tm?" \
+    "/tmp"
+check "glob without a match stays" \
+    "echo glob/*.z" \
+    "glob/*.z"
+check "glob as a redirection target" \
+    "cat < glob/c.*" \
+    "ch"
+check "glob from a variable" \
+    "echo \$V" \
+    "glob/a.c glob/b.c" \
+    "V=glob/*.c"
+
+# variables and assignments
+check "variable expansion" \
+    "echo \$V \${V}x" \
+    "v vx" \
+    "V=v"
+check "unset variable drops the word" \
+    "echo a \$UNSET b" \
+    "a b"
+check "variable holding &" \
+    "echo hi \$A" \
+    "hi &" \
+    "A=&"
+checkInput "trailing & on a word with a variable" \
+    "A=x
+echo hi\$A&
+wait" \
+    "hix"
+check "assignment before a command" \
+    "FOO=1 printenv FOO" \
+    "1"
+checkInput "assignment before a command stays its own" \
+    "FOO=1 printenv FOO
+echo x\$FOO" \
+    "1
+x"
+checkInput "shell variable is not exported" \
+    "FOO=1
+printenv FOO
+export FOO
+printenv FOO" \
+    "1"
+check "assignment before exec" \
+    "FOO=1 exec printenv FOO" \
+    "1"
+check "assignment before pin" \
+    "FOO=3 pin --cpus 0 printenv FOO" \
+    "3"
+checkInput "assignment before pin is put back" \
+    "FOO=3 pin --cpus 0 true
+echo x\$FOO
+export BAR=a
+BAR=b pin --cpus 0 printenv BAR
+printenv BAR" \
+    "x
+b
+a"
+
+# the last command replaces the shell
+check "last command is exec'd" \
+    "cat /proc/\$\$/comm" \
+    "cat"
+check "last command with a job cgroup is not exec'd" \
+    "cat /proc/\$\$/comm" \
+    "shell" \
+    "SHELL_CGROUP=$scratch/cgroup"
+
+# the zygote launcher
+checkInput "launcher follows cd" \
+    "cd /
+/bin/pwd
+cd /tmp
+/bin/pwd" \
+    "/
+/tmp" \
+    "SHELL_ZYGOTE=1"
+checkInput "launcher follows the environment" \
+    "export A=1
+printenv A
+export A=2
+printenv A
+unset A
+printenv A
+echo \$?" \
+    "1
+2
+1" \
+    "SHELL_ZYGOTE=1"
+checkInput "launcher is reaped when it dies" \
+    "pkill -P \$\$ -x shell
+sleep 0.2
+true
+ps -o stat= --ppid \$\$ | grep -c Z" \
+    "0" \
+    "SHELL_ZYGOTE=1" "SHELL_PIDFD=1"
+
+# target sets
+checkJobs "kill overlapping ranges of jobs" \
+    "sleep 5 &
+sleep 5 &
+sleep 5 &
+kill %1-%2 %2
+wait %1
+wait %2
+jobs -r
+kill -s KILL %3 %3-%3
+wait %3" \
+    "[1] PID terminated by signal 15
+[2] PID terminated by signal 15
+[3] PID Running sleep 5 &
+[3] PID terminated by signal 9"
+checkJobs "kill by state" \
+    "sleep 5 &
+kill --stopped
+kill --running
+wait
+bg --all" \
+    "[1] PID terminated by signal 15
+bg: no such jobs
+kill: no such jobs"
+
+check "repeated dup-fd redirections" \
+    "echo 2>&1 2>&1 2>&1 2>&1 2>&1 2>&1 2>&1 hi" \
+    "hi"
+check "repeated dup-fd redirections in a pipeline" \
+    "echo 2>&1 2>&1 2>&1 2>&1 2>&1 2>&1 2>&1 hi | cat 2>&1 2>&1 2>&1 2>&1 2>&1 2>&1 2>&1" \
+    "hi"
+check "wait on a job id that overflows an int" \
+    "wait %2147483648" \
+    "wait: invalid job id: %2147483648"
+check "wait on a job id past the job table" \
+    "wait %99999" \
+    "wait: invalid job id: %99999"
+check "wait on job 0" \
+    "wait %0" \
+    "wait: job not found: %0"
+check "limit on a job id that overflows an int" \
+    "limit %2147483648" \
+    "limit: invalid job id"
+check "kill on a job id that overflows an int" \
+    "kill %4294967297" \
+    "kill: invalid job id: %4294967297"
+check "fg on a range past the job table" \
+    "fg %1-%99999" \
+    "fg: invalid job id: %1-%99999"
+check "bg with overlapping targets" \
+    "bg %1-3 %2-4 --stopped" \
+    "bg: no such jobs"
+checkInput "cd stores the resolved directory in PWD" \
+    "cd /tmp
+cd ..
+echo \$PWD" \
+    "/"
+
+exit $failed